@@ -0,0 +1,31 @@
+/*
+ * boot.c
+ */ 
+
+#include "boot.h"
+
+#include <avr/io.h>
+
+#include "clock.h"
+#include "../keyboard/typing.h"
+#include "../storage/slots.h"
+#include "../usbdrv/usbdrv.h"
+
+boot_stats_t boot_stats;
+
+uint8_t boot_start () {
+	boot_stats.resetCause = MCUSR;
+	MCUSR = 0;	// So the next reset shows its own cause
+	boot_stats.detachMs = (boot_stats.resetCause & _BV(PORF)) ? BOOT_DETACH_POWER_ON : BOOT_DETACH_WARM;
+	return boot_stats.detachMs;
+}
+
+// The clock starts in setup(), a few ms after reset, plus the start-up time
+// set by the fuses. Neither is counted.
+void boot_poll () {
+	if (boot_stats.configuredMs == 0 && usbConfiguration != 0)
+		boot_stats.configuredMs = clock_ms() | 1;
+	if (boot_stats.firstKeyMs == 0 && typing_is_busy())
+		boot_stats.firstKeyMs = clock_ms() | 1;
+	boot_stats.commitMs = slot_commit_ms();
+}
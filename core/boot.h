@@ -0,0 +1,37 @@
+/*
+ * boot.h
+ */ 
+
+
+#ifndef BOOT_H_
+#define BOOT_H_
+
+#include <stdint.h>
+
+// How long D- is held low at boot to make the host enumerate again. After
+// power-on the host has never seen the device, so no detach is needed.
+// After any other reset (watchdog, brown-out, reset pin) the host may still
+// have it configured. The hub latches the disconnect as soon as it sees it,
+// so this only has to be long enough to be seen, not the 500 ms we used to
+// wait.
+#define BOOT_DETACH_POWER_ON 0	// ms
+#define BOOT_DETACH_WARM 50	// ms
+
+typedef struct {
+	uint8_t resetCause;	// MCUSR at boot
+	uint8_t detachMs;
+	uint16_t configuredMs;	// clock_ms() when the host configured us, 0 until then
+	uint16_t firstKeyMs;	// clock_ms() when typing first started, 0 until then
+	uint16_t commitMs;	// slot_commit_ms(), ms per slot of the last key generation
+	uint16_t scanUs;	// slot_scan_us(), how long the log took to scan
+} boot_stats_t;
+
+extern boot_stats_t boot_stats;
+
+// Reads and clears the reset cause, and returns the detach time for it
+uint8_t boot_start ();
+
+// Call from the main loop, records the boot benchmark times
+void boot_poll ();
+
+#endif /* BOOT_H_ */
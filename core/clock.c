@@ -0,0 +1,49 @@
+/*
+ * clock.c
+ */ 
+
+#include "clock.h"
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+#define CLOCK_PRESCALER 256
+
+static volatile uint16_t milliseconds;
+
+void clock_init () {
+	TCCR0A = _BV(WGM01);	// CTC, count to OCR0A
+	TCCR0B = _BV(CS02);	// Divide by 256 -> 64.45kHz at 16.5MHz
+	OCR0A = (F_CPU / CLOCK_PRESCALER + 500) / 1000 - 1;
+	TIMSK |= _BV(OCIE0A);
+}
+
+uint16_t clock_ms () {
+	uint16_t now;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		now = milliseconds;
+	}
+	return now;
+}
+
+uint16_t clock_us () {
+	uint16_t now;
+	uint8_t ticks;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		now = milliseconds;
+		ticks = TCNT0;
+		if (TIFR & _BV(OCF0A)) {
+			// Wrapped, and the interrupt hasn't counted it yet
+			now ++;
+			ticks = TCNT0;
+		}
+	}
+	// Tenths of a us per tick, 155 at 16.5MHz
+	return now * 1000 + ticks * (uint16_t)(CLOCK_PRESCALER * 10000000UL / F_CPU) / 10;
+}
+
+// Interrupts are enabled right away so the USB interrupt is never delayed
+ISR(TIMER0_COMPA_vect, ISR_NOBLOCK) {
+	milliseconds ++;
+}
@@ -0,0 +1,22 @@
+/*
+ * clock.h
+ */ 
+
+
+#ifndef CLOCK_H_
+#define CLOCK_H_
+
+#include <stdint.h>
+
+// Starts Timer0 as a free running millisecond counter
+void clock_init ();
+
+// Milliseconds since clock_init(), wraps after about 65 seconds
+uint16_t clock_ms ();
+
+// Microseconds since clock_init(), in steps of one Timer0 tick (15.5 us).
+// Wraps after about 65 ms, for timing short things. Counts with interrupts
+// disabled for up to one millisecond.
+uint16_t clock_us ();
+
+#endif /* CLOCK_H_ */
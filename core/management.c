@@ -0,0 +1,125 @@
+/*
+ * management.c
+ */ 
+
+#include "management.h"
+
+#include <avr/io.h>
+#include <string.h>
+
+#include "boot.h"
+#include "clock.h"
+#include "osccal.h"
+#include "../keyboard/keymap.h"
+#include "../keyboard/typing.h"
+#include "../storage/provision.h"
+
+#define SLOT_FEATURE(id)	\
+	0x85, id,                      /*   REPORT_ID (id) */	\
+	0x09, 0x02,                    /*   USAGE (Vendor Usage 2) */	\
+	0xb1, 0x02                     /*   FEATURE (Data,Var,Abs) */
+
+const PROGMEM char management_report_descriptor[MANAGEMENT_REPORT_DESCRIPTOR_LENGTH] = {
+	0x06, 0x00, 0xff,              // USAGE_PAGE (Vendor Defined Page 1)
+	0x09, 0x01,                    // USAGE (Vendor Usage 1)
+	0xa1, 0x01,                    // COLLECTION (Application)
+	0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
+	0x26, 0xff, 0x00,              //   LOGICAL_MAXIMUM (255)
+	0x75, 0x08,                    //   REPORT_SIZE (8)
+	0x95, SLOT_MAX_LENGTH,         //   REPORT_COUNT (SLOT_MAX_LENGTH)
+	SLOT_FEATURE(MANAGEMENT_ID_SLOT + 0),
+	SLOT_FEATURE(MANAGEMENT_ID_SLOT + 1),
+	SLOT_FEATURE(MANAGEMENT_ID_SLOT + 2),
+	SLOT_FEATURE(MANAGEMENT_ID_SLOT + 3),
+	SLOT_FEATURE(MANAGEMENT_ID_SLOT + 4),
+	SLOT_FEATURE(MANAGEMENT_ID_SLOT + 5),
+	SLOT_FEATURE(MANAGEMENT_ID_SLOT + 6),
+	0x85, MANAGEMENT_ID_INFO,      //   REPORT_ID (MANAGEMENT_ID_INFO)
+	0x95, PROVISION_INFO_SIZE,     //   REPORT_COUNT (PROVISION_INFO_SIZE)
+	0x09, 0x03,                    //   USAGE (Vendor Usage 3)
+	0xb1, 0x02,                    //   FEATURE (Data,Var,Abs)
+	0x85, MANAGEMENT_ID_BOOT,      //   REPORT_ID (MANAGEMENT_ID_BOOT)
+	0x95, sizeof(boot_stats_t),    //   REPORT_COUNT (sizeof(boot_stats_t))
+	0x09, 0x05,                    //   USAGE (Vendor Usage 5)
+	0xb1, 0x02,                    //   FEATURE (Data,Var,Abs)
+	0x85, MANAGEMENT_ID_STATUS,    //   REPORT_ID (MANAGEMENT_ID_STATUS)
+	0x95, 0x07,                    //   REPORT_COUNT (7)
+	0x09, 0x04,                    //   USAGE (Vendor Usage 4)
+	0x81, 0x02,                    //   INPUT (Data,Var,Abs)
+	0xc0                           // END_COLLECTION
+};
+
+static uint8_t status[8];
+static uint8_t bootReport[1 + sizeof(boot_stats_t)];
+static uint16_t lastStatus;
+static uint8_t reportId;	// Goes first in the data stage, 0 once it has
+
+usbMsgLen_t management_setup (usbRequest_t *rq, uint8_t unlocked) {
+	uint8_t id = rq->wValue.bytes[0];
+	uint8_t get = (rq->bRequest == USBRQ_HID_GET_REPORT);
+	usbMsgLen_t len;
+	uint16_t length = rq->wLength.word - 1;	// Less the report ID
+
+	if (!get && rq->bRequest != USBRQ_HID_SET_REPORT)
+		return 0;
+
+	if (id == MANAGEMENT_ID_STATUS && get) {
+		usbMsgPtr = (usbMsgPtr_t)status;
+		return sizeof(status);
+	}
+	if (id == MANAGEMENT_ID_BOOT && get) {
+		bootReport[0] = MANAGEMENT_ID_BOOT;
+		memcpy(bootReport + 1, &boot_stats, sizeof(boot_stats));
+		usbMsgPtr = (usbMsgPtr_t)bootReport;
+		return sizeof(bootReport);
+	}
+	if (id == MANAGEMENT_ID_INFO && get)
+		len = provision_start(PROVISION_RQ_INFO, 0, 0, PROVISION_INFO_SIZE);
+	else if (id >= MANAGEMENT_ID_SLOT && id < MANAGEMENT_ID_SLOT + SLOT_COUNT && unlocked) {
+		// A shorter report ends the password where it ends
+		if (!get && rq->wLength.word < 2)
+			return 0;
+		if (get || length > SLOT_MAX_LENGTH)
+			length = SLOT_MAX_LENGTH;
+		len = provision_start(get ? PROVISION_RQ_READ : PROVISION_RQ_WRITE, id - MANAGEMENT_ID_SLOT, 0, length);
+	}
+	else
+		return 0;
+
+	reportId = id;
+	return len;
+}
+
+uint8_t management_read (uint8_t *data, uint8_t len) {
+	uint8_t count = 0;
+
+	if (reportId != 0) {
+		data[count++] = reportId;
+		reportId = 0;
+	}
+	return count + provision_read(data + count, len - count);
+}
+
+uint8_t management_write (uint8_t *data, uint8_t len) {
+	if (reportId != 0 && len > 0) {
+		data ++;
+		len --;
+		reportId = 0;
+	}
+	return provision_write(data, len);
+}
+
+void management_poll (uint8_t selected) {
+	uint8_t report[8] = { MANAGEMENT_ID_STATUS, selected, keymap_layout(), typing_is_busy(), typing_leds(),
+		OSCCAL, osccal_deviation(), osccal_measurements() };
+	uint16_t now = clock_ms();
+
+	if (!usbInterruptIsReady3())
+		return;
+	if (memcmp(report, status, sizeof(report)) == 0 && (uint16_t)(now - lastStatus) < 1000)
+		return;
+
+	memcpy(status, report, sizeof(report));
+	usbSetInterrupt3(status, sizeof(status));
+	lastStatus = now;
+}
@@ -0,0 +1,45 @@
+/*
+ * management.h
+ */ 
+
+
+#ifndef MANAGEMENT_H_
+#define MANAGEMENT_H_
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+#include "../usbdrv/usbdrv.h"
+
+// Second HID interface with a vendor defined usage page. Hosts give it to
+// any program without a driver (hidapi), and nothing on it reaches the
+// keyboard interface.
+#define MANAGEMENT_INTERFACE 1
+#define MANAGEMENT_POLL_INTERVAL 100	// ms between polls of endpoint 3
+
+// Report IDs
+#define MANAGEMENT_ID_SLOT 1	// Feature 1-7: slot 0-6, up to SLOT_MAX_LENGTH. Written as
+								// characters, read as stored (see provision.h).
+								// Only while the settings LED is selected.
+#define MANAGEMENT_ID_INFO 8	// Feature: the PROVISION_RQ_INFO block
+#define MANAGEMENT_ID_STATUS 9	// Input: selected LED, layout, typing busy, host
+								// LEDs, OSCCAL, osccal_deviation() and
+								// osccal_measurements(), on endpoint 3
+#define MANAGEMENT_ID_BOOT 10	// Feature: boot_stats, see boot.h
+
+#define MANAGEMENT_REPORT_DESCRIPTOR_LENGTH 83
+extern const PROGMEM char management_report_descriptor[MANAGEMENT_REPORT_DESCRIPTOR_LENGTH];
+
+// Call from usbFunctionSetup() with class requests to MANAGEMENT_INTERFACE.
+// Slots are only accessible when unlocked is set.
+usbMsgLen_t management_setup (usbRequest_t *rq, uint8_t unlocked);
+
+// Call from usbFunctionRead() and usbFunctionWrite()
+uint8_t management_read (uint8_t *data, uint8_t len);
+uint8_t management_write (uint8_t *data, uint8_t len);
+
+// Call from the main loop. Sends a status report when something has changed,
+// and once a second otherwise.
+void management_poll (uint8_t selected);
+
+#endif /* MANAGEMENT_H_ */
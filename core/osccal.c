@@ -0,0 +1,210 @@
+/*
+ * osccal.c
+ */ 
+
+#include "osccal.h"
+
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+
+#include "clock.h"
+#include "../storage/eeprom.h"
+#include "../usbdrv/usbdrv.h"
+
+#define i_abs(x) ((x) > 0 ? (x) : -(x))
+
+
+static uint8_t measurements;
+static int8_t deviation;
+static uint16_t lastTrack;
+static int8_t lastStep;
+static uint8_t bucket = 0xFF;	// Temperature at the last track
+static uint8_t sinceMeasured;
+
+// Reads the internal temperature sensor against the 1.1 V reference. The
+// first conversion after switching reference is thrown away. Takes about
+// 300 us, and the ADC is turned off again afterwards.
+static uint8_t temperatureBucket () {
+	uint16_t reading;
+
+	ADMUX = _BV(REFS1) | 0x0F;	// 1.1 V, ADC4 (temperature)
+	for (uint8_t i = 0 ; i < 2 ; i ++) {
+		ADCSRA = _BV(ADEN) | _BV(ADSC) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);	// F_CPU / 128
+		while (ADCSRA & _BV(ADSC))
+			;
+	}
+	reading = ADC;
+	ADCSRA = 0;
+
+	if (reading < OSCCAL_TEMP_LOW)
+		return 0;
+	reading = (reading - OSCCAL_TEMP_LOW) >> OSCCAL_TEMP_SHIFT;
+	return (reading < OSCCAL_TEMP_BUCKETS) ? reading : OSCCAL_TEMP_BUCKETS - 1;
+}
+
+// Remembers cal for the current temperature once it is known to be good
+static void learn (uint8_t cal, int error) {
+	if (i_abs(error) <= OSCCAL_TRACK_THRESHOLD)
+		eeprom_update_byte(&eeprom.osccalTable[bucket], cal);
+}
+
+static void setDeviation (int error) {
+	deviation = (error > 127) ? 127 : (error < -127) ? -127 : error;
+}
+
+// Returns how much too long (positive) or too short the frame is with cal.
+// A higher OSCCAL gives a faster clock and a longer frame.
+static int measure (uint8_t cal) {
+	int frameLength;
+
+	OSCCAL = cal;
+	cli();	// The measurement is a busy loop
+	frameLength = usbMeasureFrameLength();
+	sei();
+	measurements ++;
+	return frameLength - OSCCAL_TARGET_LENGTH;
+}
+
+// Binary search in regions 0-127 and 128-255
+static uint8_t fullSearch (int *bestError) {
+	int error;
+	uint8_t trialCal;
+	uint8_t bestCal = OSCCAL;
+
+	for (uint8_t region = 0 ; region <= 1 ; region ++) {
+		error = -1;
+		trialCal = (region == 0) ? 0 : 128;
+
+		for (uint8_t step = 64; step > 0; step >>= 1) {
+			if (error < 0)	// true for initial iteration
+				trialCal += step;
+			else
+				trialCal -= step;
+
+			error = measure(trialCal);
+			if (i_abs(error) < i_abs(*bestError)) {
+				bestCal = trialCal;
+				*bestError = error;
+			}
+		}
+	}
+	return bestCal;
+}
+
+// Walks from start towards the target while it gets better. The two
+// regions overlap, so it never crosses from one to the other.
+static uint8_t warmSearch (uint8_t start, int *bestError) {
+	int error = measure(start);
+	int8_t step = (error < 0) ? 1 : -1;
+	uint8_t bestCal = start;
+	uint8_t trialCal;
+
+	*bestError = error;
+	for (uint8_t i = 0 ; i < OSCCAL_WARM_STEPS && error != 0 ; i ++) {
+		trialCal = bestCal + step;
+		if ((trialCal ^ start) & 0x80)
+			break;
+		error = measure(trialCal);
+		if (i_abs(error) >= i_abs(*bestError))
+			break;
+		bestCal = trialCal;
+		*bestError = error;
+	}
+	return bestCal;
+}
+
+void osccal_calibrate () {
+	uint8_t start, saved = eeprom_read_byte(&eeprom.osccal);
+	int error = 9999;
+	uint8_t cal = OSCCAL;
+
+	measurements = 0;
+	bucket = temperatureBucket();
+	start = eeprom_read_byte(&eeprom.osccalTable[bucket]);
+	if (start == 0xFF)
+		start = saved;
+	if (start != 0xFF)
+		cal = warmSearch(start, &error);
+	if (i_abs(error) > OSCCAL_TOLERANCE) {
+		error = 9999;
+		cal = fullSearch(&error);
+	}
+
+	OSCCAL = cal;
+	if (cal != saved)
+		eeprom_update_byte(&eeprom.osccal, cal);
+	learn(cal, error);
+	setDeviation(error);
+	lastTrack = clock_ms();
+	sinceMeasured = 0;
+}
+
+// When the temperature has changed, OSCCAL is set from the table right away.
+// Frames are only measured when the table has nothing for the temperature,
+// or every OSCCAL_TRACK_VERIFY tracks to keep the table right.
+//
+// After reset the host is idle, but now packets come in during the
+// measurement. The USB interrupt is left on so they are still answered. A
+// packet, and the time the driver spends on it, can only make a measured
+// frame shorter, so the longest of a few measurements is used. The timer
+// interrupts would shorten every frame alike and are masked, the clock
+// catches up on one tick afterwards.
+void osccal_track () {
+	int frameLength, longest = 0;
+	uint8_t cal = OSCCAL, learned, now, timers;
+	int8_t step;
+
+	if ((uint16_t)(clock_ms() - lastTrack) < OSCCAL_TRACK_INTERVAL)
+		return;
+	lastTrack = clock_ms();
+
+	now = temperatureBucket();
+	learned = eeprom_read_byte(&eeprom.osccalTable[now]);
+	if (now != bucket) {
+		bucket = now;
+		lastStep = 0;
+		if (learned != 0xFF && (uint8_t)(learned ^ cal) < 0x80)
+			OSCCAL = cal = learned;
+	}
+	if (learned != 0xFF && ++sinceMeasured < OSCCAL_TRACK_VERIFY)
+		return;
+	sinceMeasured = 0;
+
+	// 0 is a timeout, no frames while the host has us suspended. Then the
+	// rest would time out as well, each after a long busy wait.
+	for (uint8_t i = 0 ; i < OSCCAL_TRACK_SAMPLES ; i ++) {
+		timers = TIMSK;
+		TIMSK = timers & ~(_BV(OCIE0A) | _BV(TOIE1));
+		frameLength = usbMeasureFrameLength();
+		TIMSK = timers;
+		if (frameLength == 0)
+			break;
+		if (i_abs(frameLength - OSCCAL_TARGET_LENGTH) <= OSCCAL_TOLERANCE && frameLength > longest)
+			longest = frameLength;
+	}
+	if (longest == 0) {
+		lastStep = 0;
+		return;	// Nothing valid measured, OSCCAL and the table are left alone
+	}
+	setDeviation(longest - OSCCAL_TARGET_LENGTH);
+
+	// Only move when two measurements in a row agree on the direction
+	step = (deviation < -OSCCAL_TRACK_THRESHOLD) ? 1 : (deviation > OSCCAL_TRACK_THRESHOLD) ? -1 : 0;
+	if (step != 0 && step == lastStep && (uint8_t)((cal + step) ^ cal) < 0x80) {
+		OSCCAL = cal + step;
+		step = 0;
+	}
+	else if (step == 0) {
+		learn(cal, deviation);
+	}
+	lastStep = step;
+}
+
+int8_t osccal_deviation () {
+	return deviation;
+}
+
+uint8_t osccal_measurements () {
+	return measurements;
+}
@@ -0,0 +1,54 @@
+/*
+ * osccal.h
+ */ 
+
+
+#ifndef OSCCAL_H_
+#define OSCCAL_H_
+
+#include <stdint.h>
+
+// USB frame length that usbMeasureFrameLength() returns at F_CPU
+#define OSCCAL_TARGET_LENGTH (int)(1499 * (double)F_CPU / 10.5e6 + 0.5)
+
+// Deviation from OSCCAL_TARGET_LENGTH that a warm start accepts, 1%. Larger
+// deviations fall back to the full search.
+#define OSCCAL_TOLERANCE (OSCCAL_TARGET_LENGTH / 100)
+
+// Max steps a warm start walks away from the saved value
+#define OSCCAL_WARM_STEPS 3
+
+// How often osccal_track() runs, and how far off the frame length has to be
+// before it moves OSCCAL a step. One step is about 0.5%.
+#define OSCCAL_TRACK_INTERVAL 1000	// ms
+#define OSCCAL_TRACK_THRESHOLD (OSCCAL_TARGET_LENGTH / 200)
+#define OSCCAL_TRACK_SAMPLES 3
+#define OSCCAL_TRACK_VERIFY 30	// Tracks between measurements when the table has a value
+
+// Table of learned OSCCAL values by temperature sensor reading (ADC4 at
+// 1.1 V, about 230 at -40 C, 300 at 25 C and 370 at 85 C). Each bucket
+// covers 1 << OSCCAL_TEMP_SHIFT steps from OSCCAL_TEMP_LOW, 232 to 359,
+// about -40 to 75 C. Warmer readings share the last bucket.
+#define OSCCAL_TEMP_BUCKETS 16
+#define OSCCAL_TEMP_LOW 232
+#define OSCCAL_TEMP_SHIFT 3
+
+// Calibrates the RC oscillator against the USB frame rate. Call right after
+// a USB reset. Starts from the learned value for the temperature, or the
+// last calibration, and only does the full search (14 frame measurements)
+// when that is out of tolerance, or when nothing has been saved yet.
+void osccal_calibrate ();
+
+// Frame measurements made by the last calibration
+uint8_t osccal_measurements ();
+
+// Call from the main loop when nothing is being typed. Follows temperature
+// and voltage drift by moving OSCCAL one step at a time, and learns the
+// value for each temperature.
+void osccal_track ();
+
+// Last measured frame length minus OSCCAL_TARGET_LENGTH, limited to +-127.
+// Each unit is 7 CPU cycles, about 0.04%.
+int8_t osccal_deviation ();
+
+#endif /* OSCCAL_H_ */
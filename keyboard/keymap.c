@@ -0,0 +1,119 @@
+/*
+ * keymap.c
+ */ 
+
+#include "keymap.h"
+
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#include <string.h>
+
+#include "../storage/eeprom.h"
+
+#define S(code) (KEY_SHIFT | (code))
+#define A(code) (KEY_ALTGR | (code))
+
+#define LAYOUT(id, name, deadKeys)
+#define KEY(ch, ...) { __VA_ARGS__ },
+// Keys for ASCII 0x20 (space) to 0x7E (~), one column for each layout
+static const PROGMEM uint8_t keymap_keys[95][KEYMAP_LAYOUTS] = {
+#include "layouts.def"
+};
+#undef KEY
+#undef LAYOUT
+
+#define KEY(ch, ...)
+#define LAYOUT(id, name, deadKeys) static const PROGMEM char name_##id[] = name;
+#include "layouts.def"
+#undef LAYOUT
+#define LAYOUT(id, name, deadKeys) static const PROGMEM char dead_##id[] = deadKeys;
+#include "layouts.def"
+#undef LAYOUT
+#define LAYOUT(id, name, deadKeys) name_##id,
+static PGM_P const PROGMEM keymap_names[KEYMAP_LAYOUTS] = {
+#include "layouts.def"
+};
+#undef LAYOUT
+#define LAYOUT(id, name, deadKeys) dead_##id,
+static PGM_P const PROGMEM keymap_dead_keys[KEYMAP_LAYOUTS] = {
+#include "layouts.def"
+};
+#undef LAYOUT
+#undef KEY
+
+static uint8_t layout;
+static uint8_t spaceNext;	// The last character was typed with a dead key
+
+void keymap_init () {
+	layout = eeprom_read_byte(&eeprom.keymap);
+	if (layout >= KEYMAP_LAYOUTS)
+		layout = KEYMAP_US;
+}
+
+uint8_t keymap_layout () {
+	return layout;
+}
+
+void keymap_set_layout (uint8_t newLayout) {
+	if (newLayout >= KEYMAP_LAYOUTS)
+		return;
+	layout = newLayout;
+	eeprom_update_byte(&eeprom.keymap, layout);
+}
+
+const char *keymap_layout_name (uint8_t n) {
+	return (const char *)pgm_read_word(&keymap_names[n]);
+}
+
+uint8_t keymap_lookup (char ch) {
+	uint8_t index = ch - ' ';
+
+	if (index < sizeof(keymap_keys) / sizeof(keymap_keys[0]))
+		return pgm_read_byte(&keymap_keys[index][layout]);
+	if (ch == '\n')
+		return KEY_ENTER;
+	if (ch == '\t')
+		return KEY_TAB;
+	return 0;
+}
+
+uint8_t keymap_is_dead (char ch) {
+	return strchr_P((PGM_P)pgm_read_word(&keymap_dead_keys[layout]), ch) != NULL;
+}
+
+uint8_t keymap_next_key (char (*source)()) {
+	uint8_t key;
+	char ch;
+
+	if (spaceNext) {
+		spaceNext = 0;
+		return KEY_SPACE;
+	}
+
+	do {
+		ch = source();
+		if (ch == 0)
+			return 0;
+	} while ((key = keymap_lookup(ch)) == 0);
+
+	spaceNext = keymap_is_dead(ch);
+	return key;
+}
+
+void keymap_reset () {
+	spaceNext = 0;
+}
+
+char keymap_to_char (uint8_t key, uint8_t n) {
+	uint8_t index;
+
+	if (key == KEY_ENTER)
+		return '\n';
+	if (key == KEY_TAB)
+		return '\t';
+	for (index = 0 ; index < sizeof(keymap_keys) / sizeof(keymap_keys[0]) ; index ++) {
+		if (pgm_read_byte(&keymap_keys[index][n]) == key)
+			return ' ' + index;
+	}
+	return 0;
+}
@@ -0,0 +1,58 @@
+/*
+ * keymap.h
+ */ 
+
+
+#ifndef KEYMAP_H_
+#define KEYMAP_H_
+
+#include <stdint.h>
+
+// A key is the HID usage code of the key in the lower 6 bits, with shift and
+// AltGr in the top bits. 0 means the character can't be typed.
+// The ISO key next to left shift (0x64) doesn't fit in 6 bits and is stored
+// as KEY_NON_US, which is a usage code no character ever maps to.
+#define KEY_SHIFT 0x80
+#define KEY_ALTGR 0x40
+#define KEY_NON_US 0x03
+#define KEY_CODE(key) (((key) & 0x3F) == KEY_NON_US ? 0x64 : ((key) & 0x3F))
+
+#define KEY_ENTER 0x28
+#define KEY_TAB 0x2B
+#define KEY_SPACE 0x2C
+
+#define LAYOUT(id, name, deadKeys) KEYMAP_##id,
+#define KEY(ch, ...)
+enum {
+#include "layouts.def"
+	KEYMAP_LAYOUTS
+};
+#undef KEY
+#undef LAYOUT
+
+// Loads the selected layout from EEPROM
+void keymap_init ();
+
+uint8_t keymap_layout ();
+void keymap_set_layout (uint8_t layout);
+
+// Returns the short name of a layout, in program memory
+const char *keymap_layout_name (uint8_t layout);
+
+// Translates a printable ASCII character, newline or tab to a key on the
+// selected layout
+uint8_t keymap_lookup (char ch);
+
+// True if the character is typed with a dead key on the selected layout
+uint8_t keymap_is_dead (char ch);
+
+// Returns the key for the next character from source that can be typed, or
+// 0 at the end. Characters typed with a dead key are followed by a space, so
+// they show up on their own. keymap_reset() starts a new text.
+uint8_t keymap_next_key (char (*source)());
+void keymap_reset ();
+
+// Returns the character a key types on the given layout, or 0 if none
+char keymap_to_char (uint8_t key, uint8_t layout);
+
+#endif /* KEYMAP_H_ */
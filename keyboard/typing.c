@@ -0,0 +1,275 @@
+/*
+ * typing.c
+ */ 
+
+#include "typing.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+
+#include "keymap.h"
+#include "../usbdrv/usbdrv.h"
+#include "../core/clock.h"
+
+keyboard_report_t keyboard_report;
+
+static typing_source_t source = NULL;
+static uint8_t current;	// The next key from source
+static const char *textPtr;	// Used by typing_start_P()
+static uint8_t keysDown = 0;
+static uint8_t pace;
+static uint16_t lastReport;
+static uint8_t ledState = 0xFF;	// 0xFF until the host has sent one
+
+#define LOCK_PRESS 0
+#define LOCK_RELEASE 1
+#define LOCK_WAIT 2
+
+static uint8_t lockKey;	// Lock key being toggled
+static uint8_t lockLed;	// and its LED
+static uint8_t toggles;	// Lock key presses left
+static uint8_t lockStep;
+static uint8_t ledsBefore;
+static uint8_t measure;	// Use the time the host takes to answer as pace
+
+#define CAPS_KEY 0x39
+#define CAPS_TURN_OFF 1
+#define CAPS_RESTORE 2
+
+static uint8_t capsStep;
+
+static uint8_t capsLockOn() {
+	return ledState != 0xFF && (ledState & CAPS_LOCK);
+}
+
+// Returns the usage code of the next key and its modifiers, or 0 at the end
+static uint8_t nextKey(uint8_t *modifier) {
+	uint8_t key = current;
+
+#if TYPING_CAPS_MODE == TYPING_CAPS_FLIP
+	// Caps Lock inverts shift for letters, but not for AltGr combinations
+	if (capsLockOn() && !(key & KEY_ALTGR) && (key & 0x3F) >= 0x04 && (key & 0x3F) <= 0x1D)
+		key ^= KEY_SHIFT;
+#endif
+	*modifier = ((key & KEY_SHIFT) ? MOD_SHIFT_LEFT : 0) | ((key & KEY_ALTGR) ? MOD_ALT_RIGHT : 0);
+	return KEY_CODE(key);
+}
+
+#if KEYBOARD_NKRO
+static uint8_t bootProtocol = 0;
+
+// Bit for a usage code in the bitmap report: 0x04-0x39 are bits 0-53,
+// followed by Num Lock and the non-US key. These are all keys that keymap.h
+// and the lock toggles use.
+static uint8_t bitOf(uint8_t keyCode) {
+	if (keyCode == 0x53)
+		return 54;
+	if (keyCode == 0x64)
+		return 55;
+	return keyCode - 0x04;
+}
+#endif
+
+static uint8_t hasKey(keyboard_report_t *report, uint8_t keyCode) {
+#if KEYBOARD_NKRO
+	if (!bootProtocol) {
+		uint8_t bit = bitOf(keyCode);
+		return report->keys[bit >> 3] & (1 << (bit & 7));
+	}
+#endif
+	return memchr(report->keycode, keyCode, sizeof(report->keycode)) != NULL;
+}
+
+static void addKey(keyboard_report_t *report, uint8_t keyCode, uint8_t count) {
+#if KEYBOARD_NKRO
+	if (!bootProtocol) {
+		uint8_t bit = bitOf(keyCode);
+		report->keys[bit >> 3] |= 1 << (bit & 7);
+		return;
+	}
+#endif
+	report->keycode[count] = keyCode;
+}
+
+// True if the key is down in the report last sent to the host
+static uint8_t isHeld(uint8_t keyCode) {
+	return keysDown && hasKey(&keyboard_report, keyCode);
+}
+
+// True if keyCode can be typed in the same report as the previous key
+static uint8_t fits(keyboard_report_t *report, uint8_t keyCode, uint8_t previous, uint8_t count) {
+#if KEYBOARD_NKRO
+	// The host handles new keys in bitmap order, which has to be typing order
+	if (!bootProtocol)
+		return bitOf(keyCode) > bitOf(previous);
+#endif
+	return count < sizeof(report->keycode) && !hasKey(report, keyCode);
+}
+
+// Puts as many of the following characters as possible into one report.
+// Hosts handle newly pressed keys in keycode[] index order, so the keys are
+// stored in the order they are typed (bitmap reports are read in usage code
+// order instead, see fits()). Keys that are down in the previous
+// report are released by this one, keys that are still held can't be
+// pressed again until the next release.
+static void packReport(uint8_t keyCode, uint8_t modifier) {
+	keyboard_report_t report;
+	uint8_t count = 0;
+	uint8_t previous;
+
+	memset(&report, 0, sizeof(report));
+	report.modifier = modifier;
+	do {
+		addKey(&report, keyCode, count++);
+		previous = keyCode;
+		current = source();
+		keyCode = nextKey(&modifier);
+	} while (keyCode != 0 && modifier == report.modifier && !isHeld(keyCode) &&
+		fits(&report, keyCode, previous, count));
+
+	keyboard_report = report;
+}
+
+static void toggleLock(uint8_t key, uint8_t led, uint8_t count) {
+	lockKey = key;
+	lockLed = led;
+	toggles = count;
+	lockStep = LOCK_PRESS;
+	measure = 0;
+}
+
+void typing_start (typing_source_t newSource, uint8_t paceMs) {
+	source = newSource;
+	current = source();
+	pace = paceMs;
+	if (pace == TYPING_PACE_HANDSHAKE) {
+		pace = TYPING_PACE_DEFAULT;
+#if TYPING_HANDSHAKE
+		if (ledState != 0xFF) {
+			toggleLock(TYPING_HANDSHAKE_KEY, TYPING_HANDSHAKE_LED, 2);	// On and off again
+			measure = 1;
+		}
+#endif
+	}
+#if TYPING_CAPS_MODE == TYPING_CAPS_TOGGLE
+	if (capsLockOn())
+		capsStep = CAPS_TURN_OFF;
+#endif
+	lastReport = clock_ms() - pace;	// First report goes out right away
+}
+
+static char textChar() {
+	return pgm_read_byte(textPtr++);
+}
+
+static uint8_t textSource() {
+	return keymap_next_key(textChar);
+}
+
+void typing_start_P (const char *text, uint8_t paceMs) {
+	textPtr = text;
+	keymap_reset();
+	typing_start(textSource, paceMs);
+}
+
+uint8_t typing_is_busy () {
+	return source != NULL || keysDown || toggles != 0 || capsStep != 0;
+}
+
+void typing_set_leds (uint8_t leds) {
+	ledState = leds;
+}
+
+uint8_t typing_leds () {
+	return ledState;
+}
+
+void typing_set_protocol (uint8_t protocol) {
+#if KEYBOARD_NKRO
+	bootProtocol = (protocol == 0);
+	memset(&keyboard_report, 0, sizeof(keyboard_report));	// Not valid in the new format
+	keysDown = 0;
+#endif
+}
+
+// Presses the lock key and waits for the host to change the LED. When
+// measuring, the time from the press to the LED report is how long the host
+// takes to handle a key and becomes the pace. A host that doesn't answer in
+// time gets no more toggles.
+static void pollLock() {
+	uint16_t elapsed = clock_ms() - lastReport;
+
+	memset(&keyboard_report, 0, sizeof(keyboard_report));
+	switch (lockStep) {
+		case LOCK_PRESS:
+			addKey(&keyboard_report, lockKey, 0);
+			ledsBefore = ledState;
+			break;
+		case LOCK_RELEASE:
+			break;
+		default:
+			if ((ledState ^ ledsBefore) & lockLed) {
+				if (measure && elapsed > pace)
+					pace = (elapsed > 0xFF) ? 0xFF : elapsed;
+				toggles --;
+				lockStep = LOCK_PRESS;
+			}
+			else if (elapsed > TYPING_HANDSHAKE_TIMEOUT) {
+				toggles = 0;
+				// Caps Lock may not have been turned off, toggling it back
+				// at the end could leave it inverted
+				if (lockKey == CAPS_KEY && capsStep == CAPS_RESTORE)
+					capsStep = 0;
+			}
+			return;
+	}
+
+	usbSetInterrupt((void*)&keyboard_report, sizeof(keyboard_report));
+	if (lockStep++ == LOCK_PRESS)
+		lastReport = clock_ms();
+}
+
+// Reports are only sent when they change something on the host. A release
+// is inserted when the next key is already down or needs another modifier,
+// otherwise the next keys go straight into the following report.
+void typing_poll () {
+	uint8_t keyCode, modifier;
+
+	if (!typing_is_busy() || !usbInterruptIsReady())
+		return;
+	if (toggles != 0) {
+		pollLock();
+		return;
+	}
+	if (capsStep == CAPS_TURN_OFF) {
+		toggleLock(CAPS_KEY, CAPS_LOCK, 1);
+		capsStep = CAPS_RESTORE;
+		return;
+	}
+	if ((uint16_t)(clock_ms() - lastReport) < pace)
+		return;
+
+	keyCode = (source != NULL) ? nextKey(&modifier) : 0;
+	if (keyCode == 0) {
+		source = NULL;
+		if (!keysDown) {
+			if (capsStep == CAPS_RESTORE)
+				toggleLock(CAPS_KEY, CAPS_LOCK, 1);
+			capsStep = 0;
+			return;
+		}
+	}
+
+	if (keyCode == 0 || (keysDown && (modifier != keyboard_report.modifier || isHeld(keyCode)))) {
+		memset(&keyboard_report, 0, sizeof(keyboard_report));
+		keysDown = 0;
+	}
+	else {
+		packReport(keyCode, modifier);
+		keysDown = 1;
+	}
+
+	usbSetInterrupt((void*)&keyboard_report, sizeof(keyboard_report));
+	lastReport = clock_ms();
+}
@@ -0,0 +1,79 @@
+/*
+ * typing.h
+ */ 
+
+
+#ifndef TYPING_H_
+#define TYPING_H_
+
+#include <stdint.h>
+
+typedef struct {
+	uint8_t modifier;
+	union {
+		struct {
+			uint8_t reserved;
+			uint8_t keycode[6];
+		};
+		uint8_t keys[7];	// Bitmap when KEYBOARD_NKRO is set, see main.c
+	};
+} keyboard_report_t;
+
+extern keyboard_report_t keyboard_report; // sent to PC
+
+#define MOD_SHIFT_LEFT (1<<1)
+#define MOD_ALT_RIGHT (1<<6)	// AltGr
+
+// LED output report bits
+#define NUM_LOCK 1
+#define CAPS_LOCK 2
+#define SCROLL_LOCK 4
+
+// Minimum time in ms between two reports. 0 sends a report on every poll of
+// the interrupt endpoint (USB_CFG_INTR_POLL_INTERVAL). Slow hosts, remote
+// desktops and some login screens drop keys at that rate and need a slot
+// with a higher value.
+#define TYPING_PACE_DEFAULT 0
+
+// Pace value that measures the host instead. Num Lock is toggled twice before
+// typing and the time until the host echoes the LED change is used as pace.
+// Hosts that don't send LED reports get TYPING_PACE_DEFAULT.
+#define TYPING_PACE_HANDSHAKE 0xFE
+
+#define TYPING_HANDSHAKE 1	// Set to 0 to leave out the handshake code
+#define TYPING_HANDSHAKE_KEY 0x53	// Num Lock
+#define TYPING_HANDSHAKE_LED NUM_LOCK
+#define TYPING_HANDSHAKE_TIMEOUT 250	// ms to wait for an LED report
+
+// How passwords keep their case when the host has Caps Lock on
+#define TYPING_CAPS_IGNORE 0	// Type as is
+#define TYPING_CAPS_FLIP 1	// Invert shift for letters. Not on macOS, where
+							// shift doesn't undo Caps Lock.
+#define TYPING_CAPS_TOGGLE 2	// Turn Caps Lock off while typing
+#define TYPING_CAPS_MODE TYPING_CAPS_TOGGLE
+
+// Returns the next key to type (see keymap.h), or 0 when there are no more.
+// It is called when the next report is built, not ahead of time.
+typedef uint8_t (*typing_source_t)();
+
+// Starts typing the keys from source, with at least pace ms between reports
+void typing_start (typing_source_t source, uint8_t pace);
+
+// Starts typing a null terminated string in program memory
+void typing_start_P (const char *text, uint8_t pace);
+uint8_t typing_is_busy ();
+
+// Call with the LED output report from the host
+void typing_set_leds (uint8_t leds);
+
+// The last LED report, 0xFF if the host hasn't sent one
+uint8_t typing_leds ();
+
+// Call with the protocol from SET_PROTOCOL, 0 for boot and 1 for report
+void typing_set_protocol (uint8_t protocol);
+
+// Call from the main loop. Sends the next report when the interrupt
+// endpoint is ready.
+void typing_poll ();
+
+#endif /* TYPING_H_ */
@@ -12,6 +12,7 @@
 #include <util/delay.h>
 #include <avr/pgmspace.h>
 #include <stdlib.h>
+#include <string.h>
 
 extern void hasUsbReset();
 
@@ -20,25 +21,20 @@ extern void hasUsbReset();
 #include "usbdrv/oddebug.h"        /* This is also an example for using debug macros */
 
 #include "ws2812/ws2812.h"
+#include "keyboard/typing.h"
+#include "keyboard/keymap.h"
+#include "core/clock.h"
+#include "storage/slots.h"
+#include "storage/eeprom.h"
+#include "storage/provision.h"
+#include "storage/eewrite.h"
+#include "core/management.h"
+#include "core/osccal.h"
+#include "core/boot.h"
 
 #define PASS_LENGTH 10 // password length for generated password
 #define SEND_ENTER 0 // define to 1 if you want to send ENTER after password
 
-// The buffer needs to accommodate the messages above and the password
-#define MSG_BUFFER_SIZE 32
-EEMEM uchar stored_passwords[MSG_BUFFER_SIZE * 7];
-
-/*EEMEM uchar stored_passwords[7][MSG_BUFFER_SIZE] = {
-    { "012345678901234567890123456789\n" },
-    { "abcdefghijklmnopqrstuvwxyz1234\n" },
-    { "ABCDEFGHIJKLMNOPQRSTUVWXYZ5678\n" },
-
-    { "abcde01234ABCDE56789abcdefghij\n" },
-    { "aabbccddeeffgghhiijjkkllmmnnoo\n" },
-    { "AABBCCDDEEFFGGHHIIJJKKLLMMNNOO\n" },
-    { "12345_12345-12345_12345-12345_\n" },
-};*/
-
 // ************************
 // *** USB HID ROUTINES ***
 // ************************
@@ -57,9 +53,11 @@ const PROGMEM char usbHidReportDescriptor[USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH]
 	0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
 	0x25, 0x01,                    //   LOGICAL_MAXIMUM (1)
 	0x81, 0x02,                    //   INPUT (Data,Var,Abs) ; Modifier byte
+#if !KEYBOARD_NKRO
 	0x95, 0x01,                    //   REPORT_COUNT (1)
 	0x75, 0x08,                    //   REPORT_SIZE (8)
 	0x81, 0x03,                    //   INPUT (Cnst,Var,Abs) ; Reserved byte
+#endif
 	0x95, 0x05,                    //   REPORT_COUNT (5)
 	0x75, 0x01,                    //   REPORT_SIZE (1)
 	0x05, 0x08,                    //   USAGE_PAGE (LEDs)
@@ -69,6 +67,21 @@ const PROGMEM char usbHidReportDescriptor[USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH]
 	0x95, 0x01,                    //   REPORT_COUNT (1)
 	0x75, 0x03,                    //   REPORT_SIZE (3)
 	0x91, 0x03,                    //   OUTPUT (Cnst,Var,Abs) ; LED report padding
+#if KEYBOARD_NKRO
+	// 56 bit key bitmap in place of the reserved byte and key array. It only
+	// covers the keys that keymap.h and typing.c use, see bitOf() in typing.c.
+	0x95, 0x36,                    //   REPORT_COUNT (54)
+	0x75, 0x01,                    //   REPORT_SIZE (1)
+	0x05, 0x07,                    //   USAGE_PAGE (Keyboard)(Key Codes)
+	0x19, 0x04,                    //   USAGE_MINIMUM (Keyboard a and A)(4)
+	0x29, 0x39,                    //   USAGE_MAXIMUM (Keyboard Caps Lock)(57)
+	0x81, 0x02,                    //   INPUT (Data,Var,Abs)
+	0x95, 0x01,                    //   REPORT_COUNT (1)
+	0x09, 0x53,                    //   USAGE (Keypad Num Lock)(83)
+	0x81, 0x02,                    //   INPUT (Data,Var,Abs)
+	0x09, 0x64,                    //   USAGE (Keyboard Non-US \ and |)(100)
+	0x81, 0x02,                    //   INPUT (Data,Var,Abs)
+#else
 	0x95, 0x06,                    //   REPORT_COUNT (6)
 	0x75, 0x08,                    //   REPORT_SIZE (8)
 	0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
@@ -77,42 +90,124 @@ const PROGMEM char usbHidReportDescriptor[USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH]
 	0x19, 0x00,                    //   USAGE_MINIMUM (Reserved (no event indicated))(0)
 	0x29, 0x65,                    //   USAGE_MAXIMUM (Keyboard Application)(101)
 	0x81, 0x00,                    //   INPUT (Data,Ary,Abs)
+#endif
 	0xc0                           // END_COLLECTION
 };
 
-typedef struct {
-	uint8_t modifier;
-	uint8_t reserved;
-	uint8_t keycode[6];
-} keyboard_report_t;
+uint8_t ledIndex = 0;
+
+// Keyboard and management interfaces. The HID descriptors are at offset 18
+// and 43, see usbFunctionDescriptor().
+PROGMEM const char usbDescriptorConfiguration[] = {
+	9,                             // sizeof(usbDescriptorConfiguration)
+	USBDESCR_CONFIG,
+	59, 0,                         // total length, see USB_CFG_DESCR_PROPS_CONFIGURATION
+	2,                             // number of interfaces
+	1,                             // index of this configuration
+	0,                             // configuration name string index
+	(1 << 7),                      // attributes: bus powered
+	USB_CFG_MAX_BUS_POWER/2,       // max USB current in 2mA units
+
+	9,                             // sizeof(usbDescrInterface)
+	USBDESCR_INTERFACE,
+	0,                             // index of this interface
+	0,                             // alternate setting
+	1,                             // number of endpoints
+	USB_CFG_INTERFACE_CLASS,
+	USB_CFG_INTERFACE_SUBCLASS,
+	USB_CFG_INTERFACE_PROTOCOL,
+	0,                             // string index for interface
+	9,                             // sizeof(usbDescrHID)
+	USBDESCR_HID,
+	0x01, 0x01,                    // HID version 1.01
+	0x00,                          // target country code
+	0x01,                          // number of report descriptors
+	0x22,                          // descriptor type: report
+	USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH, 0,
+	7,                             // sizeof(usbDescrEndpoint)
+	USBDESCR_ENDPOINT,
+	(char)0x81,                    // IN endpoint number 1
+	0x03,                          // attrib: Interrupt endpoint
+	8, 0,                          // maximum packet size
+	USB_CFG_INTR_POLL_INTERVAL,
+
+	9,                             // sizeof(usbDescrInterface)
+	USBDESCR_INTERFACE,
+	MANAGEMENT_INTERFACE,
+	0,                             // alternate setting
+	1,                             // number of endpoints
+	3,                             // HID
+	0,                             // no boot interface
+	0,
+	0,                             // string index for interface
+	9,                             // sizeof(usbDescrHID)
+	USBDESCR_HID,
+	0x01, 0x01,                    // HID version 1.01
+	0x00,                          // target country code
+	0x01,                          // number of report descriptors
+	0x22,                          // descriptor type: report
+	MANAGEMENT_REPORT_DESCRIPTOR_LENGTH, 0,
+	7,                             // sizeof(usbDescrEndpoint)
+	USBDESCR_ENDPOINT,
+	(char)(0x80 | USB_CFG_EP3_NUMBER), // IN endpoint number 3
+	0x03,                          // attrib: Interrupt endpoint
+	8, 0,                          // maximum packet size
+	MANAGEMENT_POLL_INTERVAL
+};
+
+usbMsgLen_t usbFunctionDescriptor(struct usbRequest *rq)
+{
+	uchar management = (rq->wIndex.bytes[0] == MANAGEMENT_INTERFACE);
+
+	switch (rq->wValue.bytes[1]) {
+		case USBDESCR_HID:
+			usbMsgPtr = (usbMsgPtr_t)(usbDescriptorConfiguration + (management ? 43 : 18));
+			return 9;
+
+		case USBDESCR_HID_REPORT:
+			if (management) {
+				usbMsgPtr = (usbMsgPtr_t)management_report_descriptor;
+				return MANAGEMENT_REPORT_DESCRIPTOR_LENGTH;
+			}
+			usbMsgPtr = (usbMsgPtr_t)usbHidReportDescriptor;
+			return USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH;
+	}
+	return 0;
+}
 
-static keyboard_report_t keyboard_report; // sent to PC
-volatile static uchar LED_state = 0xff; // received from PC
 static uchar idleRate; // repeat rate for keyboards
+static uchar protocol = 1; // 0 = boot protocol, 1 = report protocol
 
-#define NUM_LOCK 1
-#define CAPS_LOCK 2
-#define SCROLL_LOCK 4
+// Where the data stage of a control transfer goes
+#define TRANSFER_LEDS 0
+#define TRANSFER_VENDOR 1
+#define TRANSFER_MANAGEMENT 2
+static uchar transfer;
 
 #define STATE_SEND 1
 #define STATE_DONE 0
 
-#define MOD_SHIFT_LEFT (1<<1)
-
 usbMsgLen_t usbFunctionSetup(uchar data[8])
 {
 	usbRequest_t *rq = (void *)data;
+	// Slots can only be read and written from the host while the settings
+	// LED is selected, never behind the user's back
+	uchar unlocked = (ledIndex == 7 && !typing_is_busy());
 
-	if ((rq->bmRequestType & USBRQ_TYPE_MASK) == USBRQ_TYPE_CLASS) {
+	if ((rq->bmRequestType & USBRQ_TYPE_MASK) == USBRQ_TYPE_CLASS && rq->wIndex.bytes[0] == MANAGEMENT_INTERFACE) {
+		transfer = TRANSFER_MANAGEMENT;
+		return management_setup(rq, unlocked);
+	}
+	else if ((rq->bmRequestType & USBRQ_TYPE_MASK) == USBRQ_TYPE_CLASS) {
 		switch(rq->bRequest) {
 			case USBRQ_HID_GET_REPORT:
 				// send "no keys pressed" if asked here
 				usbMsgPtr = (usbMsgPtr_t)&keyboard_report;  //was cast to void*
-				keyboard_report.modifier = 0;
-				keyboard_report.keycode[0] = 0;
+				memset(&keyboard_report, 0, sizeof(keyboard_report));
 				return sizeof(keyboard_report);
 
 			case USBRQ_HID_SET_REPORT:
+				transfer = TRANSFER_LEDS;
 				return (rq->wLength.word == 1) ? USB_NO_MSG : 0;
 
 			case USBRQ_HID_GET_IDLE:
@@ -122,90 +217,57 @@ usbMsgLen_t usbFunctionSetup(uchar data[8])
 			case USBRQ_HID_SET_IDLE:
 				idleRate = rq->wValue.bytes[1];
 				return 0;
+
+			case USBRQ_HID_GET_PROTOCOL:
+				usbMsgPtr = (usbMsgPtr_t)&protocol;
+				return 1;
+
+			case USBRQ_HID_SET_PROTOCOL:
+				protocol = rq->wValue.bytes[0];
+				typing_set_protocol(protocol);
+				return 0;
 		}
 	}
+	else if ((rq->bmRequestType & USBRQ_TYPE_MASK) == USBRQ_TYPE_VENDOR && unlocked) {
+		transfer = TRANSFER_VENDOR;
+		return provision_setup(rq);
+	}
 	return 0;
 }
 
-#define i_abs(x) ((x) > 0 ? (x) : (-x))
-void hadUsbReset()
+// LED output report or provisioning data
+uchar usbFunctionWrite(uchar *data, uchar len)
 {
-	int frameLength;
-	int targetLength = (unsigned)(1499 * (double)F_CPU / 10.5e6 + 0.5);
-	int bestDeviation = 9999;
-	uchar trialCal;
-	uchar bestCal = OSCCAL;
-
-	// do a binary search in regions 0-127 and 128-255 to get optimum OSCCAL
-	for (int region = 0 ; region <= 1 ; region ++) {
-		frameLength = 0;
-		trialCal = (region == 0) ? 0 : 128;
-
-		for (int step = 64; step > 0; step >>= 1) {
-			if (frameLength < targetLength)	// true for initial iteration
-				trialCal += step;
-			else
-				trialCal -= step;
-
-			OSCCAL = trialCal;
-			frameLength = usbMeasureFrameLength();
-
-			if (i_abs(frameLength-targetLength) < bestDeviation) {
-				bestCal = trialCal;
-				bestDeviation = i_abs(frameLength - targetLength);
-			}
-		}
-	}
-
-	OSCCAL = bestCal;
+	if (transfer == TRANSFER_MANAGEMENT)
+		return management_write(data, len);
+	if (transfer == TRANSFER_VENDOR)
+		return provision_write(data, len);
+	if (len > 0)
+		typing_set_leds(data[0]);
+	return 1;
 }
 
-void buildReport(char ch) {
-	keyboard_report.modifier = 0;
-
-	if (ch >= '0' && ch <= '9') {
-		keyboard_report.modifier = 0;
-		keyboard_report.keycode[0] = (ch == '0') ? 39 : 30+(ch-'1');
-	}
-	else if (ch >= 'a' && ch <= 'z') {
-		keyboard_report.modifier = 0;
-		keyboard_report.keycode[0] = 4 + (ch-'a');
-	}
-	else if (ch >= 'A' && ch <= 'Z') {
-		keyboard_report.modifier = MOD_SHIFT_LEFT;
-		keyboard_report.keycode[0] = 4 + (ch-'A');
-	}
-	else {
-		keyboard_report.modifier = 0;
-		uint8_t keyCode = 0;
-
-		switch (ch) {
-			case '.':
-				keyCode = 0x37; break;
-			case '_':
-				keyboard_report.modifier = MOD_SHIFT_LEFT;	// No break here!
-			case '-':
-				keyCode = 0x2D; break;
-			case ' ':
-				keyCode = 0x2C; break;
-			case '\t':
-				keyCode = 0x2B; break;
-			case '\n':
-				keyCode = 0x28; break;
-            //default:
-                //keyCode = 0x37; break;
-		}
-		keyboard_report.keycode[0] = keyCode;
-	}
+uchar usbFunctionRead(uchar *data, uchar len)
+{
+	if (transfer == TRANSFER_MANAGEMENT)
+		return management_read(data, len);
+	return provision_read(data, len);
 }
 
-
-#define STATE_WAIT 0
-#define STATE_SEND_KEY 1
-#define STATE_RELEASE_KEY 2
+void hadUsbReset()
+{
+	// A reset returns the keyboard to the report protocol
+	protocol = 1;
+	typing_set_protocol(protocol);
+
+	// osccal uses the EEPROM too, the queue waits until it is calibrated
+	eewrite_hold();
+	slot_abandon();	// The host won't finish a write it had started
+	osccal_calibrate();
+	eewrite_release();
+}
 
 struct cRGB led[8];
-uint8_t ledIndex = 0;
 void setup() {
 	DDRB = _BV(PB1) | _BV(PB4);	// RED LED + WS2812 LED
 	PORTB = _BV(PB1);
@@ -224,6 +286,9 @@ void setup() {
     TCCR1 = 0x0F;   // Divide 16.5MHz in 16384 -> 1007 ticks/second
     TCNT1 = 155;
     TIMSK |= _BV(TOIE1); // | _BV(TOIE0);
+
+    clock_init();
+    keymap_init();
 }
 
 volatile uint16_t global_timer; // Counts upwards once every 0.1s
@@ -232,31 +297,119 @@ ISR(TIMER1_OVF_vect) {
     TCNT1 = 155;
 }
 
-char messageBuffer[MSG_BUFFER_SIZE+3];  // 2 extra bytes for newline and null termination
+static uint8_t generateSlot = SLOT_COUNT;	// SLOT_COUNT when not generating
+static uint8_t generateStep;	// Begin, SLOT_SIZE characters, end
+static uint8_t generateArmed;	// The next slot held is regenerated instead of typed
 
-char *generateNewKeys() {
+static uint8_t stirred;	// The button has been used since boot
+
+// The timing of the button, to 15.5 us, is what can't be predicted from
+// the time since boot. Every edge of it is stirred into the seed.
+static void stir() {
+    srand(rand() ^ clock_us());
+    stirred = 1;
+}
+
+static void keyGenerated() {
+    typing_start_P(PSTR("New key generated\n"), TYPING_PACE_DEFAULT);
+}
+
+// Replaces the password of one slot, the others are kept. A password staged
+// by stagePoll() only has to be committed, otherwise one is generated now.
+void generateNewKey(uint8_t slot) {
     PORTB |= _BV(PB1);
 
-    srand(global_timer);
-    for (int i=0 ; i < MSG_BUFFER_SIZE * 7 ; i ++) {
-        uchar ch = rand() % 63;
-        if (ch < 26)
-            ch = 'a' + ch;
-        else if (ch < 52)
-            ch = 'A' + ch - 26;
-        else if (ch < 62)
-            ch = '0' + ch - 52;
-        else if (ch == 62)
-            ch = '-';
-        //else if (ch == 63)
-        //    ch = '_';
-
-        wdt_reset();
-        eeprom_write_byte(&stored_passwords[i], ch);
+    if (slot_stage_commit(slot)) {
+        eewrite_when_done(keyGenerated);
+        return;
+    }
+    stir();
+    generateSlot = slot;
+    generateStep = 0;
+}
+
+// Queues the new password as fast as the EEPROM takes it, while the main
+// loop keeps polling USB. It waits for room in the log first, and gives up
+// when there won't be any, the old password is kept then.
+void generatePoll() {
+    uint8_t done = 1;
+
+    while (generateSlot < SLOT_COUNT && done) {
+        if (generateStep == 0 && !slot_fits(generateSlot, SLOT_PACKED_SIZE)) {
+            generateSlot = SLOT_COUNT;
+            PORTB &= ~_BV(PB1);
+            typing_start_P(PSTR("No room for a new key\n"), TYPING_PACE_DEFAULT);
+            return;
+        }
+        if (generateStep == 0)
+            done = slot_queue_begin(generateSlot);
+        else if (generateStep <= SLOT_SIZE) {
+            if (eewrite_pending() == EEWRITE_QUEUE)
+                return;
+            done = slot_queue(slot_code_char(rand() % 63));
+        }
+        else if ((done = slot_queue_end())) {
+            generateSlot = SLOT_COUNT;
+            eewrite_when_done(keyGenerated);
+            continue;
+        }
+        if (done)
+            generateStep ++;
+    }
+}
+
+static uint8_t stageStep;	// Begin, SLOT_SIZE characters, end
+
+// Writes the next password ahead of time while nothing else is going on,
+// see slot_stage_begin(). Waits for the first button press, until then
+// the seed only depends on how long the stick took to boot.
+void stagePoll() {
+    uint8_t done = 1;
+
+    while (done) {
+        if (stageStep == 0) {
+            if (!stirred || generateSlot != SLOT_COUNT || typing_is_busy() || !slot_stage_begin())
+                return;
+            srand(rand() ^ clock_us());
+        }
+        else if (stageStep <= SLOT_SIZE) {
+            if (eewrite_pending() == EEWRITE_QUEUE)
+                return;
+            done = slot_queue(slot_code_char(rand() % 63));
+        }
+        else if ((done = slot_stage_end())) {
+            stageStep = 0;
+            return;
+        }
+        if (done)
+            stageStep ++;
     }
+}
+
+static uint8_t sendStep;
+
+// Types the slot number, the password and a newline. The password is read
+// from EEPROM one key at a time, as the reports are built.
+uint8_t slotSource() {
+    uint8_t key;
+
+    switch (sendStep++) {
+        case 0:
+            return keymap_lookup('0'+ledIndex);
+        case 1:
+            key = slot_read();
+            if (key != 0) {
+                sendStep = 1;
+                return key;
+            }
+            return KEY_ENTER;
+    }
+    return 0;
+}
 
-    strcpy_P(messageBuffer, PSTR("New keys generated\n"));
-    return messageBuffer;
+uint8_t slotPace(uint8_t slot) {
+    uint8_t pace = eeprom_read_byte(&eeprom.pace[slot]);
+    return pace == 0xFF ? TYPING_PACE_DEFAULT : pace;
 }
 
 char *toHex (char *ptr, char ch) {
@@ -274,11 +427,19 @@ int main(void)
     //eeprom_write_byte(eeTestChar, 0x5A);
     //eeprom_write_byte(eeTestChar+1, 0x3D);
 
+	uint8_t detachMs = boot_start();
 	wdt_enable(WDTO_1S);
+
+	// Only the clock runs so far, USB is started with interrupts off
+	sei();
+	slots_init();
+	boot_stats.scanUs = slot_scan_us();
+	cli();
+
 	usbInit();
 
 	usbDeviceDisconnect();	// enforce re-enumeration
-	for (uint8_t i = 0 ; i < 250 ; i ++) {	// Wait 500ms
+	for (uint8_t i = 0 ; i < detachMs ; i += 2) {
 		wdt_reset();
 		_delay_ms(2);
 	}
@@ -287,20 +448,18 @@ int main(void)
 	PORTB &= ~_BV(PB1);
 	sei();
 
-    uint8_t state = STATE_WAIT;
-
 	uint8_t lastState = !(PINB & _BV(PB3)), btnState;
 	uint8_t timer_start = global_timer, timeout;
 
-    char *bufPtr = NULL;
-
     while (1)
     {
 		wdt_reset();
 		usbPoll();
 
 		btnState = !(PINB & _BV(PB3));
-        if (state == STATE_WAIT && bufPtr == NULL) {
+		if (btnState != lastState)
+			stir();
+        if (!typing_is_busy() && !eewrite_pending() && !slots_busy() && !provision_busy()) {
 		    if (btnState != lastState) {
 			    if (btnState) {
 				    timer_start = global_timer;
@@ -309,11 +468,25 @@ int main(void)
 				    // Button is released
                     timeout = global_timer - timer_start;
                     if (timeout > 10 && timeout < 50) {
-                        //state = STATE_SEND_KEY;
+                        if (ledIndex == 7) {
+                            // Next keyboard layout, type its name to show which one.
+                            // The slots are only switched when all of them can be.
+                            uint8_t oldLayout = keymap_layout();
+                            if (slots_relayout_fits()) {
+                                keymap_set_layout((oldLayout + 1) % KEYMAP_LAYOUTS);
+                                slots_relayout(oldLayout);
+                                typing_start_P(keymap_layout_name(keymap_layout()), TYPING_PACE_DEFAULT);
+                            }
+                            else
+                                typing_start_P(PSTR("No room to switch layout\n"), TYPING_PACE_DEFAULT);
+                        }
                     }
                     else if (timeout > 1 && timeout <= 10) {
                         ledIndex = (ledIndex+1) & 0x07;
-                        PORTB &= ~_BV(PB1);  // LED off (if it was turned on by a re-gen
+                        if (ledIndex == 7)
+                            generateArmed = 0;	// Went past all slots, cancel
+                        if (!generateArmed)
+                            PORTB &= ~_BV(PB1);  // LED off (if it was turned on by a re-gen
                 		wdt_reset();
                         ws2812_setleds(&led[ledIndex], 1);
 		                wdt_reset();
@@ -322,26 +495,21 @@ int main(void)
 		    }
             else if (btnState) {
                 timeout = global_timer - timer_start;
-                if (timeout == 10 && ledIndex != 7) {
-                    //eeprom_read_block(messageBuffer, stored_passwords[ledIndex], MSG_BUFFER_SIZE);
-                    char *ptr = messageBuffer;
-                    *ptr ++ = '0'+ledIndex;
-                    for (int idx = 0 ; idx < MSG_BUFFER_SIZE ; idx ++) {
-                        char eeChar = eeprom_read_byte((uint8_t *)&stored_passwords[ledIndex * MSG_BUFFER_SIZE + idx]);
-                        //ptr = toHex(ptr, eeChar);
-                        *ptr++ = eeChar;
-                    }
-                    *ptr ++ = '\n';
-                    *ptr = 0;
-
-                    wdt_reset();
-                    bufPtr = messageBuffer;
-                    state = STATE_SEND_KEY;
+                if (timeout == 10 && ledIndex != 7 && generateArmed) {
+                    // Confirms the regeneration, of this slot only
+                    generateArmed = 0;
+                    generateNewKey(ledIndex);
+                }
+                else if (timeout == 10 && ledIndex != 7) {
+                    slot_open(ledIndex);
+                    sendStep = 0;
+                    typing_start(slotSource, slotPace(ledIndex));
                 }
                 else if (timeout == 50 && ledIndex == 7) {
-                    bufPtr = generateNewKeys();
-                    if (bufPtr != NULL)
-                        state = STATE_SEND_KEY;
+                    // Arms a regeneration, the red LED stays on until a slot
+                    // is held to confirm it or the slots are skipped past
+                    generateArmed = 1;
+                    PORTB |= _BV(PB1);
                 }
             }
         }
@@ -349,46 +517,23 @@ int main(void)
             timer_start = global_timer;
 		lastState = btnState;
 
-		if (usbInterruptIsReady() && state != STATE_WAIT) {
-			switch (state) {
-				case STATE_SEND_KEY:
-                    if (bufPtr != NULL) {
-    					buildReport(*bufPtr);
-
-                        bufPtr ++;
-                        if (*bufPtr != 0) {
-                            state = STATE_SEND_KEY;
-                        }
-                        else {
-                            state = STATE_RELEASE_KEY;
-                            bufPtr = NULL;
-                        }
-
-    					//state = STATE_RELEASE_KEY;
-                    }
-                    else
-                        state = STATE_WAIT;
-					break;
-
-				case STATE_RELEASE_KEY:
-					buildReport(0);
-					state = STATE_WAIT;
-                    if (bufPtr != NULL) {
-                        bufPtr ++;
-                        if (*bufPtr != 0)
-                            state = STATE_SEND_KEY;
-                        else
-                            bufPtr = NULL;
-                    }
-					break;
-
-				default:
-					state = STATE_WAIT;
-			}
-
-			usbSetInterrupt((void*)&keyboard_report, sizeof(keyboard_report));
+		// The host reads the EEPROM as the packets go, nothing new is
+		// written until its transfer is done
+		provision_poll();
+		if (provision_restored()) {
+			generateSlot = SLOT_COUNT;
+			stageStep = 0;
 		}
-
+		if (!provision_busy()) {
+			generatePoll();
+			stagePoll();
+		}
+		eewrite_poll();
+		slots_poll(!typing_is_busy() && !provision_busy());
+		typing_poll();
+		management_poll(ledIndex);
+		boot_poll();
+		if (!typing_is_busy() && !eewrite_pending())
+			osccal_track();
     }
 }
-
@@ -0,0 +1,32 @@
+/*
+ * eeprom.h
+ */
+
+
+#ifndef EEPROM_H_
+#define EEPROM_H_
+
+#include <stdint.h>
+#include <avr/eeprom.h>
+
+#include "slots.h"
+#include "../core/osccal.h"
+
+// Everything kept in the EEPROM, in one variable so that the order doesn't
+// depend on how the objects are linked. The passwords stay at address 0,
+// where older firmware kept its fixed slots, see slots_init().
+typedef struct {
+	uint8_t passwords[SLOT_LOG];	// The log, see slots.h
+	uint8_t slotLayout;	// SLOT_LAYOUT once the passwords are a log
+	uint8_t keymap;	// The selected layout
+	uint8_t pace[SLOT_COUNT];	// ms between reports for each slot, 0xFF uses
+								// TYPING_PACE_DEFAULT, TYPING_PACE_HANDSHAKE
+								// measures the host
+	uint8_t osccal;	// 0xFF until the first calibration
+	uint8_t osccalTable[OSCCAL_TEMP_BUCKETS];	// OSCCAL for each temperature, 0xFF
+												// until learned
+} eeprom_t;
+
+extern eeprom_t eeprom;	// Defined in slots.c
+
+#endif /* EEPROM_H_ */
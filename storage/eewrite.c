@@ -0,0 +1,130 @@
+/*
+ * eewrite.c
+ */ 
+
+#include "eewrite.h"
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/wdt.h>
+#include <util/atomic.h>
+
+static uint16_t addresses[EEWRITE_QUEUE];	// The mode is kept in the high byte
+static uint8_t values[EEWRITE_QUEUE];
+static uint8_t head;	// Next entry to write
+static volatile uint8_t count;
+static volatile uint8_t held;	// No new writes are started
+static eewrite_done_t doneCallback;
+
+// Starts programming a cell, the EEPROM must be ready. An erased cell reads
+// 0xFF, so a write that only clears bits doesn't have to erase it first.
+static void program (uint16_t address, uint8_t data, uint8_t mode) {
+	uint8_t old;
+
+	EEAR = address;
+	if (mode == EEWRITE_UPDATE) {
+		EECR |= _BV(EERE);
+		old = EEDR;
+		if (old == data)
+			return;
+		if ((old & data) == data)
+			mode = EEWRITE_WRITE;
+		else if (data == 0xFF)
+			mode = EEWRITE_ERASE;
+		else
+			mode = EEWRITE_ATOMIC;
+	}
+
+	EEDR = data;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		EECR = mode;	// Also masks EERIE, the caller sets it again
+		EECR |= _BV(EEMPE);	// EEPE must follow within 4 cycles
+		EECR |= _BV(EEPE);
+	}
+}
+
+uint8_t eewrite_put (uint8_t *address, uint8_t data) {
+	return eewrite_put_mode(address, data, EEWRITE_UPDATE);
+}
+
+uint8_t eewrite_put_mode (uint8_t *address, uint8_t data, uint8_t mode) {
+	uint8_t tail;
+
+	if (count == EEWRITE_QUEUE)
+		return 0;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		tail = head + count;
+		if (tail >= EEWRITE_QUEUE)
+			tail -= EEWRITE_QUEUE;
+		addresses[tail] = (uint16_t)address | (mode << 8);
+		values[tail] = data;
+		count ++;
+		EECR |= _BV(EERIE);	// Fires right away if the EEPROM is idle
+	}
+	return 1;
+}
+
+uint8_t eewrite_pending () {
+	return count;
+}
+
+void eewrite_byte (uint8_t *address, uint8_t data) {
+	while (EECR & _BV(EEPE))
+		;
+	program((uint16_t)address, data, EEWRITE_UPDATE);
+}
+
+void eewrite_flush () {
+	while (count != 0)
+		wdt_reset();
+}
+
+void eewrite_hold () {
+	held = 1;
+	while (EECR & _BV(EEPE))
+		;
+}
+
+void eewrite_release () {
+	held = 0;
+	if (count != 0)
+		EECR |= _BV(EERIE);
+}
+
+void eewrite_when_done (eewrite_done_t done) {
+	doneCallback = done;
+}
+
+void eewrite_poll () {
+	eewrite_done_t done = doneCallback;
+
+	if (done == 0 || count != 0)
+		return;
+	doneCallback = 0;
+	done();
+}
+
+// The interrupt is level triggered, it fires as long as the EEPROM is idle.
+// It is masked before interrupts are enabled again, so the USB interrupt is
+// only held up by the prologue and the few cycles that start the write. An
+// unchanged byte is skipped, the interrupt then fires again right away.
+ISR(EE_RDY_vect) {
+	uint16_t address;
+	uint8_t data;
+
+	EECR &= ~_BV(EERIE);
+	if (count == 0 || held)
+		return;	// eewrite_release() unmasks it again
+	sei();
+
+	address = addresses[head];
+	data = values[head];
+	if (++head == EEWRITE_QUEUE)
+		head = 0;
+	program(address & E2END, data, (address >> 8) & EEWRITE_UPDATE);
+
+	cli();
+	count --;
+	EECR |= _BV(EERIE);
+}
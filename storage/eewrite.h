@@ -0,0 +1,56 @@
+/*
+ * eewrite.h
+ */ 
+
+
+#ifndef EEWRITE_H_
+#define EEWRITE_H_
+
+#include <stdint.h>
+#include <avr/io.h>
+
+// Bytes that can wait to be written, 3 bytes of RAM each. A write takes
+// 3.4 ms, so a full queue is about 27 ms of work.
+#define EEWRITE_QUEUE 8
+
+// Programming modes, the EEPM bits in EECR. Erase and write are 1.8 ms each,
+// an atomic erase and write 3.4 ms.
+#define EEWRITE_ATOMIC 0
+#define EEWRITE_ERASE _BV(EEPM0)	// Sets every bit, the data is ignored
+#define EEWRITE_WRITE _BV(EEPM1)	// Only clears bits, the cell must be erased
+#define EEWRITE_UPDATE (_BV(EEPM1) | _BV(EEPM0))	// Reads the cell first and picks
+								// the cheapest of the above, or
+								// skips it if it is unchanged
+
+typedef void (*eewrite_done_t) ();
+
+// Queues a byte to be written from the EE_READY interrupt, in
+// EEWRITE_UPDATE mode unless another mode is given. Returns 0 if the queue
+// is full. Nothing else may read or write the EEPROM while
+// eewrite_pending() is non-zero, the interrupt owns the address register.
+uint8_t eewrite_put (uint8_t *address, uint8_t data);
+uint8_t eewrite_put_mode (uint8_t *address, uint8_t data, uint8_t mode);
+
+// Writes a byte in EEWRITE_UPDATE mode right away, for when the queue is
+// empty. Waits for the EEPROM, up to 3.4 ms.
+void eewrite_byte (uint8_t *address, uint8_t data);
+
+// Bytes queued and not yet started
+uint8_t eewrite_pending ();
+
+// Waits for the queue to empty
+void eewrite_flush ();
+
+// Stops the interrupt from starting the next queued write, and waits for
+// the one in progress. The EEPROM can be used directly until
+// eewrite_release() lets the queue carry on. Bytes can still be queued.
+void eewrite_hold ();
+void eewrite_release ();
+
+// Calls done from eewrite_poll() once the queue has emptied
+void eewrite_when_done (eewrite_done_t done);
+
+// Call from the main loop
+void eewrite_poll ();
+
+#endif /* EEWRITE_H_ */
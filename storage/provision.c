@@ -0,0 +1,185 @@
+/*
+ * provision.c
+ */ 
+
+#include "provision.h"
+
+#include <avr/eeprom.h>
+#include <avr/wdt.h>
+
+#include "eewrite.h"
+#include "../core/clock.h"
+#include "../keyboard/keymap.h"
+
+static uint8_t request;
+static uint8_t slot;
+static uint16_t position;	// Next byte in the slot, info block or EEPROM
+static uint16_t remaining;
+static uint16_t end;	// Of the password being written, at its first 0
+static uint8_t rejected;	// Stalls the data of the OUT request
+static uint16_t lastMs;	// When the last packet came
+static uint8_t restored;
+static uint8_t writeResult;
+
+static uint8_t infoByte (uint8_t i) {
+	switch (i) {
+		case 0: return PROVISION_VERSION;
+		case 1: return SLOT_COUNT;
+		case 2: return SLOT_MAX_LENGTH;
+		case 3: return keymap_layout();
+	}
+	if (i < 4 + SLOT_COUNT)
+		return slot_get_format(i - 4);
+	return writeResult;
+}
+
+// V-USB accepts the data of an OUT request when setup returns 0, and the
+// host would take that for success. Its data stage is stalled instead.
+static usbMsgLen_t reject () {
+	remaining = 0;
+	if (request == PROVISION_RQ_WRITE)
+		writeResult = PROVISION_WRITE_BUSY;
+	if (request == PROVISION_RQ_WRITE || request == PROVISION_RQ_RESTORE) {
+		rejected = 1;
+		return USB_NO_MSG;
+	}
+	return 0;
+}
+
+usbMsgLen_t provision_start (uint8_t newRequest, uint8_t newSlot, uint16_t offset, uint16_t length) {
+	uint16_t size;
+
+	request = newRequest;
+	slot = newSlot;
+	position = offset;
+	remaining = length;
+	end = offset + length;
+	rejected = 0;
+	lastMs = clock_ms();
+	if (request == PROVISION_RQ_WRITE)
+		writeResult = PROVISION_WRITE_OK;
+
+	if (eewrite_pending() || slots_busy())
+		return reject();	// The host retries once the queued writes are done
+	slot_abandon();	// A write that was never finished
+	if (request < PROVISION_RQ_INFO || request > PROVISION_RQ_RESTORE)
+		return reject();
+	if ((request == PROVISION_RQ_READ || request == PROVISION_RQ_WRITE) && slot >= SLOT_COUNT)
+		return reject();
+	if (request == PROVISION_RQ_WRITE && offset != 0)
+		return reject();	// A password is only written whole, as a new record
+
+	if (request == PROVISION_RQ_INFO)
+		size = PROVISION_INFO_SIZE;
+	else if (request >= PROVISION_RQ_BACKUP)
+		size = PROVISION_EEPROM_SIZE;
+	else if (request == PROVISION_RQ_WRITE)
+		size = SLOT_MAX_LENGTH;
+	else
+		size = slot_get_length(slot);
+
+	if (offset > size)
+		return reject();
+	if (length > size - offset) {
+		if (request == PROVISION_RQ_WRITE || request == PROVISION_RQ_RESTORE)
+			return reject();
+		remaining = size - offset;	// Reads stop at the end
+	}
+
+	if (request == PROVISION_RQ_WRITE && !slot_fits(slot, length)) {
+		reject();
+		writeResult = PROVISION_WRITE_FULL;	// Not worth trying again
+		return USB_NO_MSG;
+	}
+	// No room until old records have been reclaimed, the host tries again
+	if (request == PROVISION_RQ_WRITE && !slot_begin(slot, length))
+		return reject();
+	return USB_NO_MSG;
+}
+
+usbMsgLen_t provision_setup (usbRequest_t *rq) {
+	if (rq->wValue.bytes[1] != 0)
+		return 0;
+	return provision_start(rq->bRequest, rq->wValue.bytes[0], rq->wIndex.word, rq->wLength.word);
+}
+
+uint8_t provision_read (uint8_t *data, uint8_t len) {
+	lastMs = clock_ms();
+	if (len > remaining)
+		len = remaining;
+	if (request == PROVISION_RQ_BACKUP) {
+		eeprom_read_block(data, (const void *)position, len);
+		position += len;
+	}
+	else {
+		for (uint8_t i = 0 ; i < len ; i ++, position ++)
+			data[i] = (request == PROVISION_RQ_INFO) ? infoByte(position) : slot_get_byte(slot, position);
+	}
+	remaining -= len;
+	return len;
+}
+
+// A changed byte takes an EEPROM cycle, 1.8 ms if it only clears bits or
+// only sets them and 3.4 ms otherwise. The driver NAKs the next packet until
+// this returns, so the host is paced by the EEPROM.
+uint8_t provision_write (uint8_t *data, uint8_t len) {
+	if (rejected)
+		return 0xFF;
+	lastMs = clock_ms();
+	if (len > remaining)
+		len = remaining;
+	for (uint8_t i = 0 ; i < len ; i ++, position ++) {
+		wdt_reset();
+		if (request == PROVISION_RQ_RESTORE)
+			eewrite_byte((uint8_t *)position, data[i]);
+		else if (data[i] == 0 && position < end)
+			end = position;
+		else if (position < end && !slot_write(slot, position, data[i])) {
+			rejected = 1;	// Can't be typed, the rest is stalled too
+			remaining = 0;
+			writeResult = PROVISION_WRITE_UNTYPABLE;
+			return 0xFF;
+		}
+	}
+	remaining -= len;
+	if (remaining != 0)
+		return 0;
+
+	if (request == PROVISION_RQ_RESTORE) {
+		keymap_init();	// The selected layout may have changed
+		slots_init();
+		restored = 1;
+	}
+	else
+		slot_end(slot);
+	return 1;
+}
+
+uint8_t provision_busy () {
+	return remaining != 0;
+}
+
+// What the host left half done is closed, and packets that still come are
+// stalled
+void provision_poll () {
+	if (remaining == 0 || (uint16_t)(clock_ms() - lastMs) < PROVISION_TIMEOUT)
+		return;
+	remaining = 0;
+	rejected = 1;
+
+	if (request == PROVISION_RQ_WRITE)
+		slot_abandon();
+	else if (request == PROVISION_RQ_RESTORE) {
+		// Part of the image is written, the RAM copy of the log is stale
+		keymap_init();
+		slots_init();
+		restored = 1;
+	}
+}
+
+uint8_t provision_restored () {
+	uint8_t was = restored;
+
+	restored = 0;
+	return was;
+}
@@ -0,0 +1,74 @@
+/*
+ * provision.h
+ */ 
+
+
+#ifndef PROVISION_H_
+#define PROVISION_H_
+
+#include <stdint.h>
+#include <avr/io.h>
+
+#include "slots.h"
+#include "../usbdrv/usbdrv.h"
+
+// Vendor requests on the control endpoint, used by tools/provision.py. READ
+// and WRITE take the slot in wValue and the first byte in wIndex, and may
+// cover a whole slot in one transfer. BACKUP and RESTORE take the first
+// EEPROM address in wIndex and cover all of it in one long transfer.
+#define PROVISION_RQ_INFO 0x01	// IN: PROVISION_VERSION, SLOT_COUNT,
+								// SLOT_MAX_LENGTH, layout, the format of
+								// each slot and how the last WRITE ended
+#define PROVISION_RQ_READ 0x02	// IN: bytes as stored in the slot, as many as
+								// it holds
+#define PROVISION_RQ_WRITE 0x03	// OUT: characters, stored in SLOT_FORMAT. A
+								// new password of up to wLength bytes, ended
+								// early by a 0, from offset 0 only. Stalls
+								// while old records are reclaimed to make
+								// room, and for good at a character that
+								// can't be typed on the selected layout.
+#define PROVISION_RQ_BACKUP 0x04	// IN: the EEPROM image
+#define PROVISION_RQ_RESTORE 0x05	// OUT: the EEPROM image, written as it arrives
+
+#define PROVISION_VERSION 5
+#define PROVISION_INFO_SIZE (5 + SLOT_COUNT)
+
+// How the last WRITE ended, the last byte of the info block
+#define PROVISION_WRITE_OK 0	// Or still going
+#define PROVISION_WRITE_BUSY 1	// Refused, try again later
+#define PROVISION_WRITE_UNTYPABLE 2	// A character the layout can't type, the
+									// record was dropped
+#define PROVISION_WRITE_FULL 3	// Doesn't fit next to the other slots, see
+								// slot_fits()
+#define PROVISION_EEPROM_SIZE (E2END + 1)
+
+// A transfer the host stops sending packets for is taken as given up after
+// this many ms
+#define PROVISION_TIMEOUT 500
+
+// Call from usbFunctionSetup() with vendor requests
+usbMsgLen_t provision_setup (usbRequest_t *rq);
+
+// Starts a transfer of length bytes from offset, for other ways to reach
+// the slots. Returns USB_NO_MSG, or 0 if the request is not valid. An OUT
+// request that is not valid, or has to wait, is stalled in its data stage.
+usbMsgLen_t provision_start (uint8_t request, uint8_t slot, uint16_t offset, uint16_t length);
+
+// Call from usbFunctionRead() and usbFunctionWrite()
+uint8_t provision_read (uint8_t *data, uint8_t len);
+uint8_t provision_write (uint8_t *data, uint8_t len);
+
+// Returns 1 while a transfer has bytes left. Nothing else may write to the
+// EEPROM then, provision_read() reads it as the packets go out.
+uint8_t provision_busy ();
+
+// Call from the main loop. Ends a transfer after PROVISION_TIMEOUT ms
+// without a packet: an unfinished WRITE is abandoned, and the slots are
+// loaded again after an unfinished RESTORE.
+void provision_poll ();
+
+// Returns 1 once after a RESTORE has loaded the slots again. Records that
+// were being written before it are gone.
+uint8_t provision_restored ();
+
+#endif /* PROVISION_H_ */
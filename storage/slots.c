@@ -0,0 +1,763 @@
+/*
+ * slots.c
+ */ 
+
+#include "slots.h"
+
+#include <avr/eeprom.h>
+#include <avr/wdt.h>
+#include <util/crc16.h>
+
+#include "eeprom.h"
+#include "eewrite.h"
+#include "../core/clock.h"
+#include "../keyboard/keymap.h"
+
+EEMEM eeprom_t eeprom;	// The only EEMEM variable, so it starts at address 0
+
+#define HEADER_LENGTH 0
+#define HEADER_SEQUENCE 1
+#define HEADER_CRC 3
+#define HEADER_SLOT 5
+
+// Older firmware kept SLOT_SIZE bytes for each slot at the start of
+// the EEPROM, followed by the format of each slot
+#define LEGACY_FORMATS (SLOT_COUNT * SLOT_SIZE)
+#define LEGACY_END (LEGACY_FORMATS + SLOT_COUNT)
+
+/*EEMEM uint8_t stored_passwords[SLOT_COUNT][SLOT_SIZE] = {
+    { "012345678901234567890123456789\n" },
+    { "abcdefghijklmnopqrstuvwxyz1234\n" },
+    { "ABCDEFGHIJKLMNOPQRSTUVWXYZ5678\n" },
+
+    { "abcde01234ABCDE56789abcdefghij\n" },
+    { "aabbccddeeffgghhiijjkkllmmnnoo\n" },
+    { "AABBCCDDEEFFGGHHIIJJKKLLMMNNOO\n" },
+    { "12345_12345-12345_12345-12345_\n" },
+};*/
+
+static uint16_t readOffset;
+static uint8_t remaining;
+static uint8_t readFormat;
+static uint8_t readBits;	// Unused bits of the last packed byte read
+static uint8_t readCount;
+
+// The current record of each slot, found by scan(). The main loop can't
+// read the EEPROM while writes are queued.
+static uint16_t offsets[SLOT_COUNT];	// Of the data, SLOT_LOG for an empty slot
+static uint8_t lengths[SLOT_COUNT];
+static uint8_t formats[SLOT_COUNT];
+static uint16_t head;	// Where the next record goes
+static uint16_t tail;	// The oldest record, the gap is from head to here
+static uint16_t gap;	// Erased bytes from head on
+static uint16_t sequence;	// Of the next record
+
+static uint16_t newAt = SLOT_LOG;	// Record being written, SLOT_LOG if none
+static uint8_t newSlot;
+static uint8_t newFormat;
+static uint8_t newIndex;	// Bytes written
+static uint8_t newQueued;
+static uint16_t newCrc;
+static uint8_t writeBits;	// Packed bits that don't fill a byte yet
+static uint8_t writeCount;
+
+static uint16_t stagedAt = SLOT_LOG;	// A packed password without its slot yet, SLOT_LOG if none
+static uint16_t stagedCrc;	// Of all but its slot byte
+
+static uint8_t erasing;	// Bytes of the oldest record left to erase
+static uint8_t moving;	// The oldest record is being copied to the head
+static uint16_t wanted;	// Gap a record is waiting for, 0 if none
+static uint8_t copies;	// Made for it, gives up when all slots have moved
+
+static uint8_t relayouts;	// SLOT_KEYS slots still to translate, a bit each
+static uint8_t relayoutFrom;	// Layout their keys are for
+
+static uint8_t commits;	// Slots queued since commitStart
+static uint16_t commitStart;
+static uint16_t commitMs;
+static uint16_t scanUs;
+
+// Records run on from the end of the log to its start
+static uint16_t wrap (uint16_t offset) {
+	return (offset >= SLOT_LOG) ? offset - SLOT_LOG : offset;
+}
+
+static uint8_t *cell (uint16_t offset) {
+	return &eeprom.passwords[wrap(offset)];
+}
+
+static uint8_t readCell (uint16_t offset) {
+	return eeprom_read_byte(cell(offset));
+}
+
+// The format is kept in the high nibble of the slot byte, as 0 to 2
+static uint8_t formatCode (uint8_t format) {
+	return (format == SLOT_ASCII) ? 0 : format;
+}
+
+// Returns the slot of the record at offset, or SLOT_COUNT if there is no
+// committed record with a matching CRC there
+static uint8_t checkRecord (uint16_t offset) {
+	uint8_t length = readCell(offset + HEADER_LENGTH);
+	uint8_t slot;
+	uint16_t crc = 0xFFFF;
+
+	if (length > SLOT_MAX_LENGTH)
+		return SLOT_COUNT;
+	slot = readCell(offset + HEADER_SLOT);
+	if ((slot & 0x0F) >= SLOT_COUNT || (slot >> 4) > formatCode(SLOT_PACKED))
+		return SLOT_COUNT;
+
+	for (uint8_t i = 0 ; i < length ; i ++)
+		crc = _crc_ccitt_update(crc, readCell(offset + SLOT_HEADER + i));
+	crc = _crc_ccitt_update(crc, length);
+	crc = _crc_ccitt_update(crc, readCell(offset + HEADER_SEQUENCE));
+	crc = _crc_ccitt_update(crc, readCell(offset + HEADER_SEQUENCE + 1));
+	crc = _crc_ccitt_update(crc, slot);
+	if (crc != (readCell(offset + HEADER_CRC) | (readCell(offset + HEADER_CRC + 1) << 8)))
+		return SLOT_COUNT;
+	return slot & 0x0F;
+}
+
+// Walks the log once from the start, skipping the erased bytes and
+// anything that isn't a valid record, like the end of one that runs on from
+// the end of the log. Sequence numbers are compared as a difference, so
+// they can wrap.
+static void scan () {
+	uint16_t offset = 0, number, numbers[SLOT_COUNT];
+	uint8_t slot, length, found = 0;
+
+	for (slot = 0 ; slot < SLOT_COUNT ; slot ++) {
+		offsets[slot] = SLOT_LOG;
+		lengths[slot] = 0;
+		formats[slot] = SLOT_FORMAT;
+	}
+	head = 0;
+	sequence = 0;
+
+	while (offset < SLOT_LOG) {
+		slot = checkRecord(offset);
+		if (slot == SLOT_COUNT) {
+			offset ++;
+			continue;
+		}
+		length = readCell(offset + HEADER_LENGTH);
+		number = readCell(offset + HEADER_SEQUENCE) | (readCell(offset + HEADER_SEQUENCE + 1) << 8);
+		if (offsets[slot] == SLOT_LOG || (int16_t)(number - numbers[slot]) > 0) {
+			numbers[slot] = number;
+			offsets[slot] = wrap(offset + SLOT_HEADER);
+			lengths[slot] = length;
+			formats[slot] = readCell(offset + HEADER_SLOT) >> 4;
+			if (formats[slot] == 0)
+				formats[slot] = SLOT_ASCII;
+		}
+		if (!found || (int16_t)(number - sequence) >= 0) {
+			sequence = number + 1;
+			head = wrap(offset + SLOT_HEADER + length);
+		}
+		found = 1;
+		offset += SLOT_HEADER + length;
+	}
+}
+
+// The gap goes from the newest record to the oldest one. A record that was
+// cut off before it was committed is in the way, and is erased.
+static void eraseGap () {
+	tail = head;
+	for (gap = 0 ; gap < SLOT_LOG ; gap ++) {
+		if (readCell(tail) != 0xFF) {
+			if (checkRecord(tail) != SLOT_COUNT)
+				break;
+			wdt_reset();
+			eewrite_byte(cell(tail), 0xFF);
+		}
+		tail = wrap(tail + 1);
+	}
+}
+
+void slot_open (uint8_t slot) {
+	readOffset = offsets[slot];
+	remaining = lengths[slot];
+	readFormat = formats[slot];
+	if (readFormat == SLOT_PACKED)
+		remaining = remaining * 4 / 3;	// Characters
+	readBits = 0;	// Left over when a packed password ended early
+	readCount = 0;
+	keymap_reset();
+}
+
+static char readByte () {
+	char ch;
+
+	if (remaining == 0)
+		return 0;
+
+	ch = readCell(readOffset++);
+	remaining = (ch == 0) ? 0 : remaining - 1;
+	return ch;
+}
+
+char slot_code_char (uint8_t code) {
+	if (code < 26)
+		return 'a' + code;
+	if (code < 52)
+		return 'A' + code - 26;
+	if (code < 62)
+		return '0' + code - 52;
+	return '-';
+}
+
+static uint8_t charCode (char ch) {
+	if (ch >= 'a' && ch <= 'z')
+		return ch - 'a';
+	if (ch >= 'A' && ch <= 'Z')
+		return ch - 'A' + 26;
+	if (ch >= '0' && ch <= '9')
+		return ch - '0' + 52;
+	return 62;
+}
+
+// Codes are stored low bits first, a byte is read every 4 of 3 characters.
+// No buffer is needed, the unused bits of the last byte are kept.
+static char readPacked () {
+	uint8_t code, next;
+
+	if (remaining == 0)
+		return 0;
+	remaining --;
+
+	if (readCount < 6) {
+		next = readCell(readOffset++);
+		code = (readBits | (next << readCount)) & 0x3F;
+		readBits = next >> (6 - readCount);
+		readCount += 2;
+	}
+	else {
+		code = readBits & 0x3F;
+		readBits >>= 6;
+		readCount -= 6;
+	}
+
+	if (code == SLOT_PACKED_END) {
+		remaining = 0;
+		return 0;
+	}
+	return slot_code_char(code);
+}
+
+uint8_t slot_read () {
+	if (readFormat == SLOT_KEYS)
+		return readByte();
+	if (readFormat == SLOT_PACKED)
+		return keymap_next_key(readPacked);
+	return keymap_next_key(readByte);
+}
+
+// Starts a record at the head, and returns 0 if it doesn't fit with
+// reserve bytes of the gap left after it
+static uint8_t append (uint8_t slot, uint8_t format, uint8_t length, uint16_t reserve, uint8_t queued) {
+	if (newAt != SLOT_LOG || gap < SLOT_HEADER + length + reserve)
+		return 0;
+
+	// A staged password is older than this record now, and can't be
+	// committed any more. It is left to be erased.
+	if (slot != SLOT_COUNT)
+		stagedAt = SLOT_LOG;
+	newAt = head;
+	newSlot = slot;
+	newFormat = format;
+	newIndex = 0;
+	newQueued = queued;
+	newCrc = 0xFFFF;
+	return 1;
+}
+
+// Writes the next data byte of the new record, returns 0 if the queue is
+// full. The gap is erased, so 0xFF needs no write.
+static uint8_t appendByte (uint8_t data) {
+	uint8_t *ptr = cell(newAt + SLOT_HEADER + newIndex);
+
+	if (newAt == SLOT_LOG)
+		return 0;
+	if (!newQueued)
+		eewrite_byte(ptr, data);
+	else if (data != 0xFF && !eewrite_put(ptr, data))
+		return 0;
+	newCrc = _crc_ccitt_update(newCrc, data);
+	newIndex ++;
+	return 1;
+}
+
+static void put (uint16_t offset, uint8_t data, uint8_t queued) {
+	if (queued)
+		eewrite_put(cell(offset), data);
+	else
+		eewrite_byte(cell(offset), data);
+}
+
+// Writes the length and sequence number of the new record and moves the
+// head past it. Returns the CRC so far.
+static uint16_t appendHeader () {
+	uint8_t header[HEADER_CRC] = { newIndex, sequence, sequence >> 8 };
+	uint16_t crc = newCrc;
+
+	for (uint8_t i = 0 ; i < HEADER_CRC ; i ++) {
+		put(newAt + i, header[i], newQueued);
+		crc = _crc_ccitt_update(crc, header[i]);
+	}
+
+	gap -= SLOT_HEADER + newIndex;
+	head = wrap(newAt + SLOT_HEADER + newIndex);
+	sequence ++;
+	newAt = SLOT_LOG;
+	return crc;
+}
+
+// Writes the CRC and then the slot byte, which commits the record at
+// offset, and switches the slot over to it
+static void commit (uint16_t offset, uint16_t crc, uint8_t slot, uint8_t format, uint8_t length, uint8_t queued) {
+	uint8_t code = slot | (formatCode(format) << 4);
+
+	crc = _crc_ccitt_update(crc, code);
+	put(offset + HEADER_CRC, crc, queued);
+	put(offset + HEADER_CRC + 1, crc >> 8, queued);
+	put(offset + HEADER_SLOT, code, queued);
+
+	offsets[slot] = wrap(offset + SLOT_HEADER);
+	lengths[slot] = length;
+	formats[slot] = format;
+}
+
+// Writes the whole header, the queue must have room for SLOT_HEADER bytes
+static void appendEnd () {
+	uint16_t offset = newAt;
+	uint8_t slot = newSlot, format = newFormat, length = newIndex, queued = newQueued;
+
+	commit(offset, appendHeader(), slot, format, length, queued);
+}
+
+// Room a slot is counted for, at least that of a generated password
+static uint8_t counted (uint8_t length) {
+	return SLOT_HEADER + ((length < SLOT_PACKED_SIZE) ? SLOT_PACKED_SIZE : length);
+}
+
+// The record is written next to the old one of the slot, and afterwards
+// there has to be room to generate any slot the same way. Since every slot
+// is counted as at least a generated password, generating one always fits.
+uint8_t slot_fits (uint8_t slot, uint8_t length) {
+	uint16_t total = 0;
+
+	for (uint8_t i = 0 ; i < SLOT_COUNT ; i ++)
+		total += counted(lengths[i]);
+	if (total + SLOT_HEADER + length + SLOT_RESERVE > SLOT_LOG)
+		return 0;
+	total += counted(length) - counted(lengths[slot]);
+	return total + SLOT_HEADER + SLOT_PACKED_SIZE + SLOT_RESERVE <= SLOT_LOG;
+}
+
+// Starts a new version of a slot. When it doesn't fit yet, slots_poll() is
+// told how much room it needs.
+static uint8_t begin (uint8_t slot, uint8_t format, uint8_t length, uint16_t reserve, uint8_t queued) {
+	if (!slot_fits(slot, length))
+		return 0;	// It never will
+	if (append(slot, format, length, reserve, queued)) {
+		wanted = 0;
+		return 1;
+	}
+	if (wanted == 0) {
+		wanted = SLOT_HEADER + length + reserve;
+		copies = 0;
+	}
+	return 0;
+}
+
+// The record is closed without a slot byte, like a staged password that is
+// dropped, and reclaim() erases it when it is the oldest one
+void slot_abandon () {
+	if (newAt == SLOT_LOG || newQueued)
+		return;
+	if (newIndex == 0)
+		newAt = SLOT_LOG;	// Nothing written yet
+	else
+		appendHeader();
+}
+
+uint8_t slot_begin (uint8_t slot, uint8_t length) {
+	if (length > SLOT_MAX_LENGTH)
+		return 0;
+
+	slot_abandon();	// One the host never finished
+	return begin(slot, SLOT_FORMAT, length, SLOT_RESERVE, 0);
+}
+
+// Returns the byte stored for ch in format, 0 if it can't be stored
+static uint8_t encode (char ch, uint8_t format) {
+	if (format == SLOT_ASCII || ch == 0)
+		return ch;
+	// A dead key needs a space after it, which doesn't fit in the slot
+	if (keymap_is_dead(ch))
+		return 0;
+	return keymap_lookup(ch);
+}
+
+uint8_t slot_write (uint8_t slot, uint8_t index, char ch) {
+	uint8_t data;
+
+	if (newAt == SLOT_LOG || newQueued || slot != newSlot || index != newIndex)
+		return 0;
+	data = encode(ch, newFormat);
+	if (data == 0) {
+		slot_abandon();
+		return 0;
+	}
+	appendByte(data);
+	return 1;
+}
+
+void slot_end (uint8_t slot) {
+	if (newAt == SLOT_LOG || newQueued || slot != newSlot)
+		return;
+	appendEnd();
+}
+
+uint8_t slot_queue_begin (uint8_t slot) {
+	if (!begin(slot, SLOT_PACKED, SLOT_PACKED_SIZE, SLOT_RESERVE, 1))
+		return 0;
+
+	writeBits = 0;
+	writeCount = 0;
+	if (commits == 0)
+		commitStart = clock_ms();
+	return 1;
+}
+
+// Written in write-only mode, the gap is erased
+uint8_t slot_queue (char ch) {
+	uint16_t bits = writeBits | (charCode(ch) << writeCount);
+
+	if (writeCount < 2) {
+		writeCount += 6;
+	}
+	else {
+		if (!appendByte(bits))
+			return 0;
+		writeCount -= 2;
+		bits >>= 8;
+	}
+	writeBits = bits;
+	return 1;
+}
+
+// Unused bits are left set, an erased code reads as SLOT_PACKED_END. Takes
+// one byte of the queue.
+static void appendPacked () {
+	if (writeCount != 0)
+		appendByte(writeBits | (0xFF << writeCount));
+	while (newIndex < SLOT_PACKED_SIZE)
+		appendByte(0xFF);
+}
+
+uint8_t slot_queue_end () {
+	if (newAt == SLOT_LOG || eewrite_pending() > EEWRITE_QUEUE - SLOT_HEADER - 1)
+		return 0;
+
+	appendPacked();
+	appendEnd();
+	commits ++;
+	return 1;
+}
+
+// Staged with room for a full length record to spare, so it doesn't take
+// the room a new record is waiting for
+uint8_t slot_stage_begin () {
+	if (stagedAt != SLOT_LOG || wanted != 0 || !append(SLOT_COUNT, SLOT_PACKED, SLOT_PACKED_SIZE, SLOT_RESERVE + SLOT_HEADER + SLOT_MAX_LENGTH, 1))
+		return 0;
+
+	writeBits = 0;
+	writeCount = 0;
+	return 1;
+}
+
+uint8_t slot_stage_end () {
+	if (newAt == SLOT_LOG || eewrite_pending() > EEWRITE_QUEUE - HEADER_CRC - 1)
+		return 0;
+
+	appendPacked();
+	stagedAt = newAt;
+	stagedCrc = appendHeader();
+	return 1;
+}
+
+uint8_t slot_stage_commit (uint8_t slot) {
+	if (stagedAt == SLOT_LOG || eewrite_pending() > EEWRITE_QUEUE - 3)
+		return 0;
+
+	if (commits == 0)
+		commitStart = clock_ms();
+	commit(stagedAt, stagedCrc, slot, SLOT_PACKED, SLOT_PACKED_SIZE, 1);
+	stagedAt = SLOT_LOG;
+	commits ++;
+	return 1;
+}
+
+// Frees the oldest record, one step per call. One that is still current is
+// copied to the head first, but only when a new record is waiting for its
+// room. A byte has to be read before it is queued, so the queue must be
+// empty, except for erasing. Returns 0 when there is nothing to do.
+static uint8_t reclaim () {
+	uint8_t slot, length;
+
+	if (erasing) {
+		while (erasing && eewrite_put(cell(tail), 0xFF)) {
+			erasing --;
+			gap ++;
+			tail = wrap(tail + 1);
+		}
+		return 1;
+	}
+	if (eewrite_pending() != 0)
+		return 1;
+
+	if (moving) {
+		if (newIndex < lengths[newSlot])
+			appendByte(readCell(offsets[newSlot] + newIndex));
+		else {
+			appendEnd();
+			moving = 0;
+		}
+		return 1;
+	}
+
+	if (gap == SLOT_LOG)
+		return 0;
+	if (tail == stagedAt) {
+		if (gap >= wanted)
+			return 0;
+		stagedAt = SLOT_LOG;	// Its room is needed
+	}
+	length = readCell(tail + HEADER_LENGTH);
+	slot = readCell(tail + HEADER_SLOT);
+	if (slot == 0xFF || offsets[slot & 0x0F] != wrap(tail + SLOT_HEADER)) {
+		// Replaced, or a staged password that was never committed
+		erasing = SLOT_HEADER + length;
+		return 1;
+	}
+	slot &= 0x0F;
+
+	if (gap >= wanted || copies > SLOT_COUNT || !append(slot, formats[slot], length, 0, 1))
+		return 0;
+	moving = 1;
+	copies ++;
+	return 1;
+}
+
+// Translates the next slot after a layout change, one byte per call, the
+// same way reclaim() copies. Keys that are dead or missing on the new
+// layout are kept as text. Returns 0 when the record has to wait for room.
+static uint8_t relayoutStep () {
+	uint8_t slot, format = SLOT_KEYS, data;
+	char ch = 0;
+
+	if (eewrite_pending() != 0)
+		return 1;
+
+	if (newAt == SLOT_LOG) {
+		for (slot = 0 ; !(relayouts & (1 << slot)) ; slot ++)
+			;
+		for (uint8_t i = 0 ; i < lengths[slot] ; i ++) {
+			ch = keymap_to_char(slot_get_byte(slot, i), relayoutFrom);
+			if (ch == 0)
+				break;	// Not a key of the old layout
+			if (encode(ch, SLOT_KEYS) == 0)
+				format = SLOT_ASCII;
+		}
+		if (ch == 0 || formats[slot] != SLOT_KEYS || !slot_fits(slot, lengths[slot])) {
+			relayouts &= ~(1 << slot);	// Kept as it is
+			return 1;
+		}
+		return begin(slot, format, lengths[slot], SLOT_RESERVE, 1);
+	}
+
+	data = (newIndex < lengths[newSlot]) ? slot_get_byte(newSlot, newIndex) : 0;
+	ch = keymap_to_char(data, relayoutFrom);
+	if (ch != 0)
+		appendByte(encode(ch, newFormat));
+	else {
+		appendEnd();
+		relayouts &= ~(1 << newSlot);
+	}
+	return 1;
+}
+
+void slots_poll (uint8_t idle) {
+	if (commits != 0 && eewrite_pending() == 0) {
+		commitMs = (uint16_t)(clock_ms() - commitStart) / commits;
+		commits = 0;
+	}
+
+	if (!idle || commits != 0)
+		return;	// Nor while a commit is timed
+	if (relayouts != 0 && !moving && !erasing && relayoutStep())
+		return;
+	if (newAt != SLOT_LOG && !moving)
+		return;	// Not while a record is being written
+	reclaim();
+}
+
+uint8_t slots_busy () {
+	return (newAt != SLOT_LOG && newQueued) || relayouts != 0;
+}
+
+uint16_t slot_commit_ms () {
+	return commitMs;
+}
+
+uint16_t slot_scan_us () {
+	return scanUs;
+}
+
+uint8_t slot_get_format (uint8_t slot) {
+	return formats[slot];
+}
+
+uint8_t slot_get_length (uint8_t slot) {
+	return lengths[slot];
+}
+
+uint8_t slot_get_byte (uint8_t slot, uint8_t index) {
+	return readCell(offsets[slot] + index);
+}
+
+// Reclaims until a record of length fits, for the callers that can block
+static uint8_t makeRoom (uint8_t length) {
+	copies = 0;
+	wanted = SLOT_HEADER + length + SLOT_RESERVE;
+	while (gap < wanted || erasing || moving) {
+		wdt_reset();
+		if (!reclaim())
+			return 0;
+		eewrite_flush();
+	}
+	return 1;
+}
+
+// Appends a slot again in another format. Keys are read as typed on
+// fromLayout and written for the selected layout.
+static uint8_t convert (uint8_t slot, uint8_t from, uint8_t fromLayout, uint8_t to) {
+	uint8_t index, data;
+	char ch;
+
+	// Check the whole slot before anything is written. Making room may move
+	// the record, so it is read again from where it is then.
+	for (uint8_t pass = 0 ; pass < 2 ; pass ++) {
+		if (pass == 1 && !(makeRoom(lengths[slot]) && append(slot, to, lengths[slot], SLOT_RESERVE, 0)))
+			return 0;
+		for (index = 0 ; index < lengths[slot] ; index ++) {
+			data = slot_get_byte(slot, index);
+			if (data == 0)
+				break;
+			ch = (from == SLOT_KEYS) ? keymap_to_char(data, fromLayout) : data;
+			if (ch == 0)
+				return 0;
+			data = encode(ch, to);
+			if (data == 0)
+				return 0;
+			if (pass == 1) {
+				wdt_reset();
+				appendByte(data);
+			}
+		}
+	}
+
+	appendEnd();
+	return 1;
+}
+
+uint8_t slot_convert (uint8_t slot, uint8_t format) {
+	uint8_t current = formats[slot];
+
+	if (current == format || offsets[slot] == SLOT_LOG)
+		return 1;
+	if (current == SLOT_PACKED || format == SLOT_PACKED)
+		return 0;
+	return convert(slot, current, keymap_layout(), format);
+}
+
+// Every translated record has the length of the old one
+uint8_t slots_relayout_fits () {
+	for (uint8_t slot = 0 ; slot < SLOT_COUNT ; slot ++) {
+		if (formats[slot] == SLOT_KEYS && !slot_fits(slot, lengths[slot]))
+			return 0;
+	}
+	return 1;
+}
+
+void slots_relayout (uint8_t oldLayout) {
+	relayoutFrom = oldLayout;
+	for (uint8_t slot = 0 ; slot < SLOT_COUNT ; slot ++) {
+		if (formats[slot] == SLOT_KEYS)
+			relayouts |= 1 << slot;
+	}
+}
+
+// Copies the fixed slots of older firmware to records, in slot order after
+// the old formats. Only the last record can run on into the start of the
+// log, when every slot is full, and slot 0 has been copied by then. A power
+// cut leaves the slots that were not copied yet as they are, and the next
+// boot copies those after the records it finds. What is left of the old
+// slots ends up in the gap and is erased.
+static void migrate () {
+	uint8_t *old, format, length, data;
+
+	scan();
+	if (sequence == 0)
+		head = LEGACY_END;	// Nothing copied yet
+	gap = SLOT_LOG;
+
+	for (uint8_t slot = 0 ; slot < SLOT_COUNT ; slot ++) {
+		if (offsets[slot] != SLOT_LOG)
+			continue;
+		old = &eeprom.passwords[slot * SLOT_SIZE];
+		for (length = 0 ; length < SLOT_SIZE ; length ++) {
+			data = eeprom_read_byte(old + length);
+			if (data == 0 || data == 0xFF)
+				break;
+		}
+		if (length == 0)
+			continue;
+
+		format = eeprom_read_byte(&eeprom.passwords[LEGACY_FORMATS + slot]);
+		append(slot, (format == SLOT_KEYS) ? SLOT_KEYS : SLOT_ASCII, length, 0, 0);
+		for (uint8_t i = 0 ; i < length ; i ++) {
+			wdt_reset();
+			appendByte(eeprom_read_byte(old + i));
+		}
+		appendEnd();
+	}
+	eewrite_byte(&eeprom.slotLayout, SLOT_LAYOUT);
+}
+
+void slots_init () {
+	uint16_t startUs, startMs;
+
+	newAt = SLOT_LOG;
+	stagedAt = SLOT_LOG;
+	erasing = 0;
+	moving = 0;
+	wanted = 0;
+	relayouts = 0;
+	if (eeprom_read_byte(&eeprom.slotLayout) != SLOT_LAYOUT)
+		migrate();
+
+	// Erasing a cut off record can take longer than clock_us() counts
+	startUs = clock_us();
+	startMs = clock_ms();
+	scan();
+	eraseGap();
+	scanUs = ((uint16_t)(clock_ms() - startMs) < 64) ? clock_us() - startUs : 0xFFFF;
+
+	for (uint8_t slot = 0 ; slot < SLOT_COUNT ; slot ++) {
+		if (formats[slot] != SLOT_FORMAT && formats[slot] != SLOT_PACKED)
+			slot_convert(slot, SLOT_FORMAT);
+	}
+}
@@ -0,0 +1,146 @@
+/*
+ * slots.h
+ */ 
+
+
+#ifndef SLOTS_H_
+#define SLOTS_H_
+
+#include <stdint.h>
+
+#define SLOT_COUNT 7
+#define SLOT_SIZE 32	// Length of a generated password, and of every slot in older firmware
+#define SLOT_MAX_LENGTH 64	// Max bytes of a stored password
+
+// The passwords are kept as a log of records, each new version of a slot is
+// appended after the last one. Nothing is written in place, so a power cut
+// at most loses the record that was being written, and the writes rotate
+// through the whole log instead of wearing out the same cells.
+//
+// A record is a header of SLOT_HEADER bytes and the stored bytes:
+//   0	length of the data, 0xFF in the erased gap
+//   1-2	sequence number, the highest one of a slot is its current version
+//   3-4	CRC-CCITT of the data and the other header bytes
+//   5	slot and format, written last. 0xFF until the record is committed.
+// A record that doesn't fit before the end of the log runs on at its start.
+#define SLOT_HEADER 6
+#define SLOT_LOG 480	// The EEPROM left over from the other settings
+
+// Erased bytes kept in front of the oldest record, so that it can always be
+// copied to the head before it is erased. New records are only accepted
+// when they leave this much, see slot_fits().
+#define SLOT_RESERVE (SLOT_HEADER + SLOT_MAX_LENGTH)
+
+// Marks that eeprom.passwords holds the log. Anything else there is taken
+// for the fixed slots of older firmware, SLOT_SIZE bytes each followed by
+// their formats, and slots_init() copies them to records.
+#define SLOT_LAYOUT 0x23
+
+// How the bytes of a slot are stored
+#define SLOT_ASCII 0xFF	// Characters (erased EEPROM reads as this)
+#define SLOT_KEYS 0x01	// Keys for the selected layout, see keymap.h
+#define SLOT_PACKED 0x02	// 6 bits per character, see slot_code_char()
+
+// Bytes a packed password of SLOT_SIZE characters takes. Unused codes are
+// left erased, code SLOT_PACKED_END ends a shorter password.
+#define SLOT_PACKED_SIZE ((SLOT_SIZE * 6 + 7) / 8)
+#define SLOT_PACKED_END 63
+
+// Format that new passwords are written in. SLOT_KEYS makes typing a pure
+// copy, SLOT_ASCII keeps the slots independent of the keyboard layout.
+#define SLOT_FORMAT SLOT_KEYS
+
+// Scans the log for the current record of each slot, and converts slots
+// written in an older format to SLOT_FORMAT. Reads every byte of the log
+// once, see boot_stats.scanUs for what that costs. Needs interrupts on for
+// the clock.
+void slots_init ();
+
+// Positions the read cursor at the start of a slot
+void slot_open (uint8_t slot);
+
+// Returns the next key of the open slot, or 0 at the end of it. Reads one
+// byte from EEPROM per call. Suitable as a typing_source_t.
+uint8_t slot_read ();
+
+// Starts a new record of up to length bytes for a slot, in SLOT_FORMAT. The
+// characters have to be written in order, and the slot only changes over
+// in slot_end(), to the ones written by then. Returns 0 if there is no
+// room, try again once slots_poll() has made it, unless slot_fits() says it
+// never will. slot_write() returns 0 and
+// abandons the record, see slot_abandon(), for a character that can't be
+// typed on the selected layout or is a dead key there.
+uint8_t slot_begin (uint8_t slot, uint8_t length);
+uint8_t slot_write (uint8_t slot, uint8_t index, char ch);
+void slot_end (uint8_t slot);
+
+// Drops a record from slot_begin() that won't be finished, when the host
+// went away or started another request. The bytes written so far are not
+// erased, the record is closed without a slot and takes its room in the log
+// until reclaimed. The queue must be empty, or held.
+void slot_abandon ();
+
+// Writes a whole new password through eewrite_put(), so the main loop keeps
+// running. The password is appended as SLOT_PACKED and replaces the old one
+// when the last byte of slot_queue_end() has been written. All three return
+// 0 if they have to wait, for room in the queue or in the log.
+uint8_t slot_queue_begin (uint8_t slot);
+uint8_t slot_queue (char ch);	// Only characters from slot_code_char()
+uint8_t slot_queue_end ();
+
+// Prepares a password in idle time, the same way but without a slot. It is
+// written up to its CRC and slot byte, so slot_stage_commit() only has to
+// write those 3 bytes to make it the new password of a slot. Anything else
+// written to the log before that drops it. slot_stage_begin() returns 0
+// while one is staged, or the log has no room to spare for it.
+uint8_t slot_stage_begin ();
+uint8_t slot_stage_end ();
+uint8_t slot_stage_commit (uint8_t slot);
+
+// Returns 1 if a record of length bytes for a slot fits in the log, once
+// slots_poll() has made room, and still leaves room to generate a new
+// password for any slot afterwards. Every slot counts as at least
+// SLOT_HEADER + SLOT_PACKED_SIZE bytes, empty ones too, so generating a
+// password only fails when the log was filled by older firmware.
+uint8_t slot_fits (uint8_t slot, uint8_t length);
+
+// Character for a code 0 to 62 of SLOT_PACKED: a-z, A-Z, 0-9 and -
+char slot_code_char (uint8_t code);
+
+// Call from the main loop. Erases the oldest records once they have been
+// replaced, and copies a current one to the head when a new record needs
+// its room. Only runs when idle, no password is being typed from the
+// EEPROM and the host isn't reading or writing it then.
+void slots_poll (uint8_t idle);
+
+// Returns 1 while a record is being queued or copied, or slots are still
+// to be translated for a new layout. No other one can be started then.
+uint8_t slots_busy ();
+
+// Average ms per slot of the last slot_queue_begin() to slot_queue_end()
+// batch, until the queue emptied
+uint16_t slot_commit_ms ();
+
+// How long the last slots_init() took to scan the log, 0xFFFF for 64 ms or
+// more. Formatting and conversion are not included.
+uint16_t slot_scan_us ();
+
+// Raw access to the stored bytes, for provisioning from the host
+uint8_t slot_get_format (uint8_t slot);
+uint8_t slot_get_length (uint8_t slot);
+uint8_t slot_get_byte (uint8_t slot, uint8_t index);
+
+// Converts the password in a slot to another format. Returns 0 if that is not
+// possible, a character that can't be typed on the selected layout can only
+// be stored as SLOT_ASCII. SLOT_PACKED slots are only written whole and
+// can't be converted, nor do they need to be.
+uint8_t slot_convert (uint8_t slot, uint8_t format);
+
+// Translates the keys in SLOT_KEYS slots after the layout has changed. Check
+// slots_relayout_fits() before the layout is changed, the log may not have
+// room for the new records. The slots are translated by slots_poll() in the
+// background, and slots_busy() returns 1 until they are done.
+uint8_t slots_relayout_fits ();
+void slots_relayout (uint8_t oldLayout);
+
+#endif /* SLOTS_H_ */
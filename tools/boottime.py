@@ -0,0 +1,51 @@
+#!/usr/bin/env python3
+#
+# boottime.py
+#
+# Prints the boot benchmark from the management interface (report 10, see
+# core/boot.h): why the stick was reset, how long it held the bus
+# disconnected, and when the host configured it and the first key was
+# typed, in ms from the clock start. Also the ms per slot of the last key
+# generation, and how long the slot log scan took. Plug the stick in, type
+# a slot, then run this.
+#
+# Requires pyusb (pip install pyusb).
+
+import struct
+import sys
+
+import usb.core
+
+VENDOR_ID = 0x16c0
+DEVICE_ID = 0x03e8
+
+MANAGEMENT_INTERFACE = 1
+ID_BOOT = 10
+
+HID_GET_REPORT = 0x01
+FEATURE = 0x03
+
+IN = usb.util.CTRL_IN | usb.util.CTRL_TYPE_CLASS | usb.util.CTRL_RECIPIENT_INTERFACE
+
+CAUSES = ["power-on", "reset pin", "brown-out", "watchdog"]
+
+
+def main():
+    dev = usb.core.find(idVendor=VENDOR_ID, idProduct=DEVICE_ID)
+    if dev is None:
+        sys.exit("KeyManager not found")
+    report = bytes(dev.ctrl_transfer(IN, HID_GET_REPORT, (FEATURE << 8) | ID_BOOT,
+        MANAGEMENT_INTERFACE, 11))
+    if len(report) < 11 or report[0] != ID_BOOT:
+        sys.exit("No boot report, the firmware is too old")
+    cause, detach, configured, first_key, commit, scan = struct.unpack("<BBHHHH", report[1:11])
+    print("reset: " + ", ".join(name for bit, name in enumerate(CAUSES) if cause & (1 << bit)))
+    print("detach: %d ms" % detach)
+    print("configured: " + ("%d ms" % configured if configured else "not yet"))
+    print("first key: " + ("%d ms" % first_key if first_key else "not yet"))
+    print("slot commit: " + ("%d ms" % commit if commit else "no keys generated yet"))
+    print("slot scan: %d us" % scan)
+
+
+if __name__ == "__main__":
+    main()
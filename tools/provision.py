@@ -0,0 +1,184 @@
+#!/usr/bin/env python3
+#
+# provision.py
+#
+# Reads and writes KeyManager slots over the vendor requests in
+# storage/provision.h. Select the settings LED (the unlit one) on the stick
+# first, the requests are ignored otherwise.
+#
+#   provision.py info
+#   provision.py dump
+#   provision.py write <slot> <password>
+#   provision.py load <file>     one password per line, slot 0 first
+#   provision.py backup <file>   the whole EEPROM in one transfer
+#   provision.py restore <file>
+#
+# Each command prints the bytes transferred and the throughput.
+#
+# Requires pyusb (pip install pyusb). On Linux the device needs a udev rule
+# or root to be opened.
+
+import sys
+import time
+
+import usb.core
+
+VENDOR_ID = 0x16c0
+DEVICE_ID = 0x03e8
+
+RQ_INFO = 0x01
+RQ_READ = 0x02
+RQ_WRITE = 0x03
+RQ_BACKUP = 0x04
+RQ_RESTORE = 0x05
+
+EEPROM_SIZE = 512
+
+IN = usb.util.CTRL_IN | usb.util.CTRL_TYPE_VENDOR | usb.util.CTRL_RECIPIENT_DEVICE
+OUT = usb.util.CTRL_OUT | usb.util.CTRL_TYPE_VENDOR | usb.util.CTRL_RECIPIENT_DEVICE
+
+LAYOUTS = ["US", "SE", "DE", "UK"]
+
+WRITE_UNTYPABLE = 2
+WRITE_FULL = 3
+
+FORMAT_ASCII = 0xff
+FORMAT_PACKED = 0x02
+PACKED_CHARS = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-"
+
+
+def unpack(data):
+    """Decodes a SLOT_PACKED slot, 6 bits per character, low bits first."""
+    bits = int.from_bytes(data, "little")
+    text = ""
+    for i in range(len(data) * 8 // 6):
+        code = (bits >> (6 * i)) & 0x3f
+        if code >= len(PACKED_CHARS):
+            break
+        text += PACKED_CHARS[code]
+    return text
+
+
+class KeyManager:
+    def __init__(self):
+        self.dev = usb.core.find(idVendor=VENDOR_ID, idProduct=DEVICE_ID)
+        if self.dev is None:
+            sys.exit("KeyManager not found")
+        info = self.dev.ctrl_transfer(IN, RQ_INFO, 0, 0, 64)
+        if len(info) < 4:
+            sys.exit("No answer, select the settings LED on the stick")
+        self.version, self.slot_count, self.slot_size, self.layout = info[:4]
+        self.formats = list(info[4:4 + self.slot_count])
+
+    def read(self, slot):
+        return bytes(self.dev.ctrl_transfer(IN, RQ_READ, slot, 0, self.slot_size))
+
+    def write(self, slot, password):
+        data = password.encode("ascii")
+        if len(data) > self.slot_size:
+            sys.exit("Slot %d: longer than %d characters" % (slot, self.slot_size))
+        if len(data) < self.slot_size:
+            data += b"\0"
+        # Stalls while the stick erases old records to make room, or for good
+        # at a character the selected layout can't type. The info block tells
+        # which one it was.
+        for attempt in range(20):
+            try:
+                self.dev.ctrl_transfer(OUT, RQ_WRITE, slot, 0, data, timeout=5000)
+                return len(data)
+            except usb.core.USBError:
+                result = self.write_result()
+                if result == WRITE_FULL:
+                    sys.exit("Slot %d: %d characters don't fit next to the other slots" % (slot, len(data)))
+                if result == WRITE_UNTYPABLE:
+                    sys.exit("Slot %d: a character can't be typed on the %s layout, nothing was stored"
+                             % (slot, LAYOUTS[self.layout] if self.layout < len(LAYOUTS) else self.layout))
+                time.sleep(0.1)
+        sys.exit("Slot %d: the stick stays busy" % slot)
+
+    def write_result(self):
+        info = self.dev.ctrl_transfer(IN, RQ_INFO, 0, 0, 64)
+        if self.version < 5 or len(info) <= 4 + self.slot_count:
+            return None
+        return info[4 + self.slot_count]
+
+
+    def backup(self):
+        return bytes(self.dev.ctrl_transfer(IN, RQ_BACKUP, 0, 0, EEPROM_SIZE))
+
+    def restore(self, image):
+        # Up to 3.4 ms per changed byte, a full image takes up to two seconds.
+        # Stalls while the stick still has writes queued.
+        for attempt in range(20):
+            try:
+                self.dev.ctrl_transfer(OUT, RQ_RESTORE, 0, 0, image, timeout=10000)
+                return len(image)
+            except usb.core.USBError:
+                time.sleep(0.1)
+        sys.exit("Restore refused, the stick stays busy")
+
+
+def timed(what, func):
+    start = time.perf_counter()
+    count = func()
+    elapsed = time.perf_counter() - start
+    print("%s: %d bytes in %.3f s, %.0f bytes/s" % (what, count, elapsed, count / elapsed))
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit("usage: provision.py info | dump | write <slot> <password> | load <file> | backup <file> | restore <file>")
+    km = KeyManager()
+    command = sys.argv[1]
+
+    if command == "info":
+        print("version %d, %d slots of up to %d bytes, layout %s" % (km.version, km.slot_count,
+            km.slot_size, LAYOUTS[km.layout] if km.layout < len(LAYOUTS) else km.layout))
+        print("slot formats: " + " ".join("%02x" % f for f in km.formats))
+
+    elif command == "dump":
+        def dump():
+            count = 0
+            for slot in range(km.slot_count):
+                data = km.read(slot)
+                count += len(data)
+                text = data.split(b"\0")[0]
+                if km.formats[slot] == FORMAT_ASCII:
+                    print("%d: %s" % (slot, text.decode("ascii", "replace")))
+                elif km.formats[slot] == FORMAT_PACKED:
+                    print("%d: %s" % (slot, unpack(data)))
+                else:
+                    print("%d: %s (keys)" % (slot, text.hex()))
+            return count
+        timed("read", dump)
+
+    elif command == "write":
+        slot = int(sys.argv[2])
+        timed("write", lambda: km.write(slot, sys.argv[3]))
+
+    elif command == "load":
+        with open(sys.argv[2]) as f:
+            passwords = f.read().splitlines()[:km.slot_count]
+        timed("write", lambda: sum(km.write(slot, p) for slot, p in enumerate(passwords)))
+
+    elif command == "backup":
+        def backup():
+            image = km.backup()
+            with open(sys.argv[2], "wb") as f:
+                f.write(image)
+            return len(image)
+        timed("backup", backup)
+
+    elif command == "restore":
+        with open(sys.argv[2], "rb") as f:
+            image = f.read()
+        if len(image) != EEPROM_SIZE:
+            sys.exit("Expected an image of %d bytes" % EEPROM_SIZE)
+        timed("restore", lambda: km.restore(image))
+
+    else:
+        sys.exit("Unknown command " + command)
+
+
+if __name__ == "__main__":
+    main()